@@ -3,6 +3,7 @@
 
 #include "objects.h"
 
-void LoadTestModel(std::vector<Object *> &scene);
+void LoadTestModel(std::vector<Object *> &scene,
+                   std::vector<Material> &materials);
 
 #endif
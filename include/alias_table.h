@@ -0,0 +1,26 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <stdint.h>
+#include <vector>
+
+// Walker/Vose alias table: draws index i with probability weights[i] / sum in
+// constant time, whatever the number of entries
+struct AliasTable {
+ public:
+  void build(const std::vector<float> &weights);
+  // Index for the uniform sample u in [0, 1), and the probability it had
+  uint32_t sample(float u, float &pmf) const;
+  float pmf(uint32_t index) const { return probabilities[index]; }
+  uint32_t size() const { return probabilities.size(); }
+
+ private:
+  struct Bin {
+    float threshold;
+    uint32_t alias;
+  };
+  std::vector<Bin> bins;
+  std::vector<float> probabilities;
+};
+
+#endif
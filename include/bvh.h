@@ -2,12 +2,70 @@
 #define BVH_H
 
 #include <glm/glm.hpp>
+#include <memory>
 #include <queue>
 #include <vector>
+#include "aligned_allocator.h"
+#include "mapped_file.h"
 #include "objects.h"
+#include "simd.h"
 
 const uint32_t normalsSize = 7;
 
+enum BVHType { BVH_OCTREE, BVH_SAH, BVH_WIDE };
+
+// The name --bvh takes for type: octree, sah or wide
+const char* BVHTypeName(BVHType type);
+
+// Array a tree's nodes live in. Builders fill it like a vector, while trees
+// loaded from a cache file point it straight into the file's mapping, which
+// it then keeps open. Copying would leave it pointing into the original.
+template <typename T>
+class MappedArray {
+ public:
+  MappedArray() {}
+  MappedArray(const MappedArray&) = delete;
+  MappedArray& operator=(const MappedArray&) = delete;
+
+  void push_back(const T& value) {
+    owned.push_back(value);
+    update();
+  }
+  void resize(size_t count) {
+    owned.resize(count);
+    update();
+  }
+  void reserve(size_t count) {
+    owned.reserve(count);
+    update();
+  }
+  // Views count elements starting offset bytes into the file
+  void map(const std::shared_ptr<MappedFile>& file, size_t offset,
+           size_t count) {
+    owned.clear();
+    mapping = file;
+    first = reinterpret_cast<T*>(file->data + offset);
+    elements = count;
+  }
+
+  T& operator[](size_t i) { return first[i]; }
+  const T& operator[](size_t i) const { return first[i]; }
+  const T* data() const { return first; }
+  size_t size() const { return elements; }
+  bool empty() const { return elements == 0; }
+
+ private:
+  void update() {
+    first = owned.data();
+    elements = owned.size();
+  }
+
+  std::vector<T, AlignedAllocator<T>> owned;
+  std::shared_ptr<MappedFile> mapping;
+  T* first = nullptr;
+  size_t elements = 0;
+};
+
 class BBox {
  public:
   BBox();
@@ -16,12 +74,55 @@ class BBox {
   glm::vec3 centroid() const;
   glm::vec3& operator[](bool i) { return bounds[i]; };
   const glm::vec3 operator[](bool i) const { return bounds[i]; };
+  BBox& extendBy(const BBox& bbox);
+  float surfaceArea() const;
+  uint8_t maxExtent() const;
   bool intersect(const glm::vec3& start, const glm::vec3& direction,
                  const glm::vec3& sign, float& minDist) const;
+  bool intersect(const glm::vec3& start, const glm::vec3& invDirection,
+                 const int dirIsNeg[3], float& tNear, float& tFar) const;
   glm::vec3 bounds[2] = {glm::vec3(INFINITY), glm::vec3(-INFINITY)};
 };
 
-struct BVH {
+// A tile of rays traced together. Rays are kept as given and also split into
+// structure of arrays for testing a box against several rays at once.
+struct alignas(64) RayPacket {
+  static const uint32_t maxSize = 64;
+
+  Ray rays[maxSize];
+  float startX[maxSize], startY[maxSize], startZ[maxSize];
+  float invX[maxSize], invY[maxSize], invZ[maxSize];
+  uint32_t size = 0;
+
+  void add(const Ray& ray);
+  // True when every ray's direction has the same signs, which is what lets
+  // the packet be bounded by a single frustum
+  bool coherent() const;
+};
+
+struct AccelerationStructure {
+  virtual ~AccelerationStructure() {}
+  virtual bool intersect(Ray ray, Intersection& intersection) const = 0;
+  // Falls back to tracing every ray of the packet on its own
+  virtual void intersect(const RayPacket& packet,
+                         Intersection* intersections) const;
+  // Whether anything is hit closer than maxDistance. Falls back to a closest
+  // hit query for structures without an early out.
+  virtual bool occluded(Ray ray, float maxDistance) const;
+  // Fits the node bounds to where the primitives are now, keeping the tree as
+  // it was built. Returns false for structures that can only be rebuilt.
+  virtual bool refit() { return false; }
+  // Surface area heuristic cost of the tree: the area of every node relative
+  // to the root's, weighted by the primitives its leaves test. Refitting
+  // stretches boxes over primitives that have moved apart, so the cost grows
+  // as the tree degrades. Zero for structures that don't keep it.
+  virtual float sahCost() const { return 0; }
+
+  // sahCost when the tree was built, what refits are measured against
+  float builtCost = 0;
+};
+
+struct BVH : public AccelerationStructure {
   struct Extents {
     Extents();
     void extendBy(const Extents& extents);
@@ -69,7 +170,188 @@ struct BVH {
 
  public:
   BVH(std::vector<Object*> scene);
-  bool intersect(Ray ray, Intersection& intersection) const;
+  ~BVH() { delete octree; }
+  bool intersect(Ray ray, Intersection& intersection) const override;
+};
+
+// BVH over individual primitives, split with a binned surface area heuristic
+struct SAHBVH : public AccelerationStructure {
+  struct PrimitiveInfo {
+    BBox bbox;
+    glm::vec3 centroid;
+    uint32_t index;
+  };
+
+  struct BuildNode {
+    BBox bbox;
+    BuildNode* child[2] = {nullptr, nullptr};
+    uint32_t firstPrimitive = 0;
+    uint32_t primitiveCount = 0;
+    uint8_t axis = 0;
+    bool isLeaf() const { return child[0] == nullptr; };
+  };
+
+  // Flattened node, two to a cache line. Siblings are stored next to each
+  // other so an interior node's children are tested from a single line.
+  struct alignas(32) LinearNode {
+    BBox bbox;
+    union {
+      uint32_t primitivesOffset;  // leaf
+      uint32_t childOffset;       // interior, children at offset and offset+1
+    };
+    // Share one word so the node stays 32 bytes. build refuses leaves with
+    // more primitives than the count can hold.
+    uint32_t primitiveCount : 24;  // 0 for interior nodes
+    uint32_t axis : 8;
+    bool isLeaf() const { return primitiveCount > 0; };
+  };
+
+  struct StackElement {
+    uint32_t node;
+    float distance;
+  };
+
+  static const uint32_t maxDepth = 64;
+  // Most primitives LinearNode::primitiveCount can hold
+  static const uint32_t maxLeafPrimitives = (1u << 24) - 1;
+
+  std::vector<Primitive*> primitives;
+  MappedArray<LinearNode> nodes;
+  uint32_t maxLeafSize;
+
+ public:
+  SAHBVH(std::vector<Object*> scene, uint32_t maxLeafSize = 4);
+  // An empty tree, for LoadBVHCache to fill in
+  SAHBVH() : maxLeafSize(0) {}
+  bool intersect(Ray ray, Intersection& intersection) const override;
+  bool occluded(Ray ray, float maxDistance) const override;
+  bool refit() override;
+  float sahCost() const override;
+
+ private:
+  // Builds the subtree over primitiveInfo[start, end), reordering that range
+  // so that every leaf's primitives end up next to each other in it. Large
+  // subtrees are handed to other threads as OpenMP tasks.
+  BuildNode* build(std::vector<PrimitiveInfo>& primitiveInfo, uint32_t start,
+                   uint32_t end, uint32_t depth);
+  void flatten(const BuildNode* node, uint32_t offset);
+  void deleteBuildNode(BuildNode*& node);
+};
+
+// SAH BVH collapsed to SIMD_WIDTH children per node, so that a single vector
+// slab test covers every child of the node being visited
+struct WideBVH : public AccelerationStructure {
+  static const uint32_t width = SIMD_WIDTH;
+
+  // Child boxes stored as structure of arrays, one lane per child. Unused
+  // lanes hold an inverted box that no ray can hit.
+  struct alignas(64) Node {
+    float bboxMin[3][width];
+    float bboxMax[3][width];
+    uint32_t offset[width];     // node index, or first pack for leaves
+    uint32_t packCount[width];  // 0 for interior children
+  };
+
+  // A leaf's triangles, one per lane, stored as the first vertex and the two
+  // edges leaving it. Lanes holding any other kind of primitive are flagged
+  // in scalarMask and go through Primitive::intersect instead, while unused
+  // lanes have zero edges and can never be hit.
+  struct alignas(64) TrianglePack {
+    float v0[3][width];
+    float e1[3][width];
+    float e2[3][width];
+    uint32_t primitive[width];
+    uint32_t scalarMask;
+  };
+
+  struct StackElement {
+    uint32_t offset;
+    uint32_t packCount;
+    float distance;
+  };
+
+  struct PacketStackElement {
+    uint32_t offset;
+    uint32_t packCount;
+    uint64_t rayMask;
+  };
+
+  std::vector<Primitive*> primitives;
+  MappedArray<Node> nodes;
+  MappedArray<TrianglePack> packs;
+
+ public:
+  WideBVH(std::vector<Object*> scene);
+  // An empty tree, for LoadBVHCache to fill in
+  WideBVH() {}
+  bool intersect(Ray ray, Intersection& intersection) const override;
+  void intersect(const RayPacket& packet,
+                 Intersection* intersections) const override;
+  bool occluded(Ray ray, float maxDistance) const override;
+  bool refit() override;
+  float sahCost() const override;
+
+ private:
+  uint32_t collapse(const SAHBVH& binary, uint32_t binaryNode);
+  // Reserves the packs of a leaf, filled in later by load
+  uint32_t pack(uint32_t firstPrimitive, uint32_t primitiveCount);
+  void load(TrianglePack& pack);
+  void intersect(const TrianglePack& pack, const Ray& ray, float& minDist,
+                 Primitive*& closestPrimitive) const;
+  // Reloads the pack's triangles from its primitives, returns their bounds
+  BBox refit(TrianglePack& pack);
+};
+
+// A mesh placed in the world by a transform. Rays are moved into the mesh's
+// own space and traced against its bottom level structure, or against each of
+// its primitives when it has none. Hits come back in world space, with their
+// normal filled in.
+struct Instance {
+  Object* mesh;
+  const AccelerationStructure* blas = nullptr;
+  glm::mat4 objectToWorld;
+  glm::mat4 worldToObject;
+  BBox meshBounds;  // in the mesh's space
+  BBox bbox;        // in world space
+
+  Instance(Object* mesh, const glm::mat4& transform);
+  void setTransform(const glm::mat4& transform);
+  // Bounds the mesh again once its primitives have moved
+  void updateBounds();
+  bool intersect(const Ray& ray, Intersection& intersection) const;
+  bool occluded(const Ray& ray, float maxDistance) const;
+
+ private:
+  // The ray in the mesh's space with a unit direction. Distances along it are
+  // scale times those along the world space ray.
+  Ray toObject(const Ray& ray, float& scale) const;
+};
+
+// Top level of a two level hierarchy: a binary BVH over the world space bounds
+// of the instances, next to the structure holding everything not instanced.
+// Moving an instance only means building this level again. Unlike the others
+// it fills in the normal of every hit.
+struct TopLevelBVH : public AccelerationStructure {
+  struct Node {
+    BBox bbox;
+    uint32_t offset;  // leaf: first instance, interior: first of two children
+    uint32_t count;   // 0 for interior nodes
+  };
+
+  static const uint32_t maxDepth = 64;
+
+  const AccelerationStructure* world;
+  std::vector<const Instance*> instances;
+  std::vector<Node> nodes;
+
+ public:
+  TopLevelBVH(const AccelerationStructure* world,
+              const std::vector<Instance*>& instances);
+  bool intersect(Ray ray, Intersection& intersection) const override;
+  bool occluded(Ray ray, float maxDistance) const override;
+
+ private:
+  void build(uint32_t node, uint32_t start, uint32_t end, uint32_t depth);
 };
 
 #endif
\ No newline at end of file
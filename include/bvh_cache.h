@@ -0,0 +1,26 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "objects.h"
+
+/* Built trees can be written to a cache file and mapped back in on later runs,
+ * so that unchanged scenes start without a build. Nodes are traced straight
+ * from the mapping rather than being read in. A cache is keyed on a hash of
+ * the geometry it was built over and of the node layout, and is ignored when
+ * either has changed. SAH and wide BVHs are cached, octrees are not. */
+
+// The tree of the given type cached at path for objects, or NULL when there
+// is no cache there or it is out of date
+AccelerationStructure* LoadBVHCache(const std::string& path, BVHType type,
+                                    const std::vector<Object*>& objects);
+// Writes a tree built over objects to path, returns false if it is not one
+// that can be cached or the file couldn't be written
+bool SaveBVHCache(const std::string& path,
+                  const AccelerationStructure* structure,
+                  const std::vector<Object*>& objects);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <glm/glm.hpp>
+
+#include "objects.h"
+#include "render_settings.h"
+#include "sampler.h"
+#include "scene.h"
+
+#define LIGHT_SAMPLES 1
+#define STOCHASTIC_FRESNEL
+
+// What the integrator renders and how, filled in by the program's main before
+// the first path is traced
+extern Scene *scene;
+extern RenderSettings settings;
+
+// Part of a path still to be traced: the ray leaving its last vertex and the
+// weight anything found along it is scaled by
+struct PathSegment {
+  Ray ray;
+  glm::vec3 throughput;
+  float ior;
+  int bounce;
+  // Solid angle pdf the ray was sampled with, zero when no light sample could
+  // have found the same path (camera rays and glass)
+  float bsdfPdf;
+};
+
+// A direction drawn from a surface's BSDF: the path's throughput is scaled by
+// weight, which is f * cos / pdf
+struct BSDFSample {
+  glm::vec3 direction;
+  glm::vec3 weight;
+  float pdf;
+  bool specular;
+};
+
+// Radiance arriving at start from direction dir, traced as a full path
+glm::vec3 Light(const glm::vec4 start, const glm::vec4 dir, Sampler &sampler,
+                float currIor = 1.f, int bounce = 0);
+// Radiance leaving the hit back along dir, for a primary hit found elsewhere
+glm::vec3 Shade(const Intersection &intersection, const glm::vec4 dir,
+                Sampler &sampler, float currIor = 1.f, int bounce = 0);
+
+/* The opaque surface model: a Lambertian lobe plus a normalised Phong lobe
+ * around the mirror direction, scaled down together if the material reflects
+ * more than it receives. wo is the incoming ray direction and n must face it,
+ * wi points away from the surface. */
+glm::vec3 EvalBSDF(const Material &material, const glm::vec3 &wo,
+                   const glm::vec3 &n, const glm::vec3 &wi);
+float BSDFPdf(const Material &material, const glm::vec3 &wo,
+              const glm::vec3 &n, const glm::vec3 &wi);
+// Picks a lobe by its share of the reflectance, then a direction from it.
+// Returns false if the direction ended up below the surface.
+bool SampleBSDF(const Material &material, const glm::vec3 &wo,
+                const glm::vec3 &n, Sampler &sampler, BSDFSample &sample);
+// One light sample of next event estimation, MIS weighted against the BSDF
+// sample that could have found the same point. Fills in the shadow ray to
+// test and what it adds if unblocked, returns false if it can add nothing.
+bool SampleDirectLight(const Material &material, const glm::vec4 &position,
+                       const glm::vec3 &wo, const glm::vec3 &n,
+                       Sampler &sampler, Ray &shadow, float &maxDistance,
+                       glm::vec3 &contribution);
+// MIS weight of emission found by a BSDF sampled ray along dir. Emitters only
+// light the side their normal faces, so hits on the back weigh nothing.
+float EmissionWeight(const Intersection &hit, const glm::vec4 &dir,
+                     float bsdfPdf);
+glm::vec3 cosineSampleHemisphere(const glm::vec2 &u);
+glm::vec3 samplePhongLobe(float exponent, const glm::vec2 &u);
+void createCoordinateSystem(const glm::vec3 &N, glm::vec3 &Nt,
+                            glm::vec3 &Nb);
+void fresnel(glm::vec4 I, glm::vec4 N, float ior, float &kr);
+float max3(glm::vec3);
+
+#endif
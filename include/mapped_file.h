@@ -0,0 +1,29 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iosfwd>
+#include <string>
+
+// A whole file mapped into memory for as long as this lives. The mapping is
+// private, so it can be written to without the changes ever reaching the file.
+struct MappedFile {
+  char* data = nullptr;
+  size_t size = 0;
+
+  // data is left null if the file can't be opened, is empty or can't be mapped
+  MappedFile(const std::string& path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// Rounds offset up to a multiple of alignment, which is a power of two
+uint64_t alignOffset(uint64_t offset, uint64_t alignment);
+// Pads the file with zeros up to offset before writing, for files laid out to
+// be mapped back with their arrays aligned
+void writeAt(std::ostream& file, uint64_t offset, const void* data,
+             uint64_t bytes);
+
+#endif
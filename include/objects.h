@@ -2,6 +2,7 @@
 #define OBJECTS_H
 
 #include <glm/glm.hpp>
+#include <stdint.h>
 #include <map>
 #include <opencv/cv.hpp>
 #include <string>
@@ -18,6 +19,8 @@ struct Intersection {
   glm::vec4 position;
   float distance;
   Primitive *primitive;
+  // World space surface normal, filled in by Scene::intersect
+  glm::vec4 normal;
 };
 
 struct Texture {
@@ -64,6 +67,8 @@ struct Material {
   Texture *displacementTexture;
   Texture *alphaTexture;
   Texture *reflectionTexture;
+
+  bool isLight() const;
 };
 
 struct Vertex {
@@ -80,13 +85,18 @@ struct Vertex {
 
 struct Primitive {
  public:
-  Material material;
+  // Index into the materials of the scene holding it
+  uint32_t materialId;
 
-  Primitive(Material material);
+  Primitive(uint32_t materialId);
+  virtual ~Primitive() {}
   virtual float intersect(Ray ray);
-  virtual glm::vec4 randomPoint();
+  // Point on the surface for the uniform sample u in [0, 1)^2
+  virtual glm::vec4 randomPoint(const glm::vec2 &u);
   virtual glm::vec4 getNormal(const glm::vec4 &p);
-  virtual bool isLight();
+  virtual float area();
+  virtual void computeBounds(const glm::vec3 &planeNormal, float &dnear,
+                             float &dfar);
 };
 
 struct Object {
@@ -105,10 +115,13 @@ class Triangle : public Primitive {
   glm::vec3 e1;
   glm::vec3 e2;
 
-  Triangle(Vertex v0, Vertex v1, Vertex v2, Material material);
+  Triangle(Vertex v0, Vertex v1, Vertex v2, uint32_t materialId);
   glm::vec4 getNormal(const glm::vec4 &p = glm::vec4(0)) override;
-  glm::vec4 randomPoint() override;
+  glm::vec4 randomPoint(const glm::vec2 &u) override;
   float intersect(Ray ray) override;
+  float area() override;
+  void computeBounds(const glm::vec3 &planeNormal, float &dnear,
+                     float &dfar) override;
   void ComputeNormal();
 
  private:
@@ -120,9 +133,12 @@ class Sphere : public Primitive {
   glm::vec4 c;
   float radius;
 
-  Sphere(glm::vec4 c, float radius, Material material);
+  Sphere(glm::vec4 c, float radius, uint32_t materialId);
   glm::vec4 getNormal(const glm::vec4 &p) override;
   float intersect(Ray ray) override;
+  float area() override;
+  void computeBounds(const glm::vec3 &planeNormal, float &dnear,
+                     float &dfar) override;
 };
 
 #endif
@@ -8,5 +8,8 @@
 cv::Mat cvUnpackDepthBuffer(screen *s);
 void findEdges(cv::Mat &mat);
 void maskImage(cv::Mat im1, cv::Mat im2, cv::Mat mask, cv::Mat &out);
+// Edge-aware a-trous wavelet filter (SVGF style) over the raytraced image,
+// guided by its first hit albedo, normal and depth. Fills s->denoised.
+void denoise(screen *s, int iterations = 5);
 
 #endif
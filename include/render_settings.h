@@ -0,0 +1,45 @@
+#ifndef RENDER_SETTINGS_H
+#define RENDER_SETTINGS_H
+
+#include <iostream>
+#include <string>
+
+#include "bvh.h"
+
+// Hard cap on maxBounces, which sizes the path stack in Shade
+#define MAX_BOUNCES_LIMIT 64
+
+// Everything about a render that can be chosen on the command line. The
+// defaults are the interactive setup the raytracer always had.
+struct RenderSettings {
+  int width = 240;
+  int height = 240;
+  bool fullscreen = false;
+  int minBounces = 5;
+  int maxBounces = 10;
+  bool antialiasing = false;
+  bool useBVH = true;
+  BVHType bvhType = BVH_WIDE;
+  bool denoise = true;
+  // Headless renders go straight to `output` without opening a window, and
+  // stop after `samplesPerPixel` camera rays per pixel or `timeBudget` seconds,
+  // whichever comes first. Zero means no limit, but one of them must be set.
+  bool headless = false;
+  int samplesPerPixel = 0;
+  float timeBudget = 0;
+  std::string output = "screenshot.png";
+  // Per frame counters are appended here as JSON lines when set
+  std::string statsPath;
+  // OBJ or .scene file to render, the built in test scene when empty
+  std::string scenePath;
+  // Keep the scene's BVH in scenePath + ".bvh" to skip the build next time
+  bool bvhCache = true;
+};
+
+// Fills settings from argv, returns false with a message on `error` if the
+// arguments make no sense
+bool ParseRenderSettings(int argc, char *argv[], RenderSettings &settings,
+                         std::ostream &error);
+void PrintUsage(const char *program, std::ostream &out);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+// Source of the random numbers used by one sample of one pixel. Samplers are
+// cheap value types made on the stack by whoever traces the sample, so there is
+// no state shared between threads and no lock to take.
+class Sampler {
+ public:
+  virtual ~Sampler() {}
+  // Restart the sequence for sample `index` of pixel (x, y)
+  virtual void startSample(uint32_t x, uint32_t y, uint32_t index) = 0;
+  virtual float get1D() = 0;
+  virtual glm::vec2 get2D() = 0;
+};
+
+// Independent uniform numbers from a PCG32 stream keyed on the pixel and
+// sample index
+class PCGSampler : public Sampler {
+ public:
+  void startSample(uint32_t x, uint32_t y, uint32_t index) override;
+  float get1D() override;
+  glm::vec2 get2D() override;
+
+ private:
+  uint64_t state;
+  uint64_t increment;
+
+  uint32_t next();
+};
+
+// 2D Sobol points, Owen scrambled with Burley's hash based nested uniform
+// scrambling. Every call takes the next dimension, which gets its own seed, and
+// the point index is shuffled per pixel, so pixels and dimensions decorrelate
+// while each pixel still sweeps a well stratified sequence over the frames.
+class SobolSampler : public Sampler {
+ public:
+  void startSample(uint32_t x, uint32_t y, uint32_t index) override;
+  float get1D() override;
+  glm::vec2 get2D() override;
+
+ private:
+  uint32_t seed;
+  uint32_t index;
+  uint32_t dimension;
+};
+
+#endif
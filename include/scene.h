@@ -1,23 +1,80 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <map>
+#include <unordered_map>
 #include <vector>
 
+#include "alias_table.h"
 #include "bvh.h"
 #include "objects.h"
 
 struct Scene {
  public:
   std::vector<Object *> objects;
+  // Meshes placed by a transform, traced through a structure of their own
+  // under a top level one. Only objects are searched for emitters, so lights
+  // should not be instanced.
+  std::vector<Instance *> instances;
+  // Every material of the scene. Primitives refer to these by index, so each
+  // material is converted and stored once however many faces use it.
+  std::vector<Material> materials;
+  // Every emissive primitive, gathered when the scene is loaded
+  std::vector<Primitive *> emitters;
   Scene();
   Scene(std::vector<Object *> objects);
+  // Frees the objects, instances and meshes along with their primitives
+  ~Scene();
+  Scene(const Scene &) = delete;
+  Scene &operator=(const Scene &) = delete;
   bool intersect(Ray ray, Intersection &intersection);
-  void createBVH();
+  void intersect(const RayPacket &packet, Intersection *intersections);
+  bool occluded(Ray ray, float maxDistance);
+  // Appends material to materials and returns its index
+  uint32_t addMaterial(const Material &material);
+  const Material &material(const Primitive *primitive) const {
+    return materials[primitive->materialId];
+  }
+  // Scenes without instances are loaded from the cache at cachePath when it
+  // holds a tree of this type over the same geometry, and cached there
+  // whenever they have to be built. No cache is used when it is empty.
+  void createBVH(BVHType type = BVH_WIDE, const std::string &cachePath = "");
+  // Instances added after createBVH are only traced once it is called again.
+  // The scene frees mesh, which any number of instances may share.
+  Instance *addInstance(Object *mesh, const glm::mat4 &transform);
+  // Rebuilds the top level structure, but none of the meshes' own
+  void moveInstance(uint32_t index, const glm::mat4 &transform);
+  // Brings the structures from createBVH up to date once primitives have
+  // moved, which for triangles means after Triangle::ComputeNormal. Trees are
+  // refitted in place, and only rebuilt once refitting has let their SAH cost
+  // grow past rebuildRatio times what it was when built. Returns whether any
+  // were rebuilt. Emitters are weighed again by buildEmitters.
+  bool updateBVH(float rebuildRatio = 1.5f);
+  void buildEmitters();
+  // Pick an emitter in proportion to its area times power, returns NULL if
+  // the scene has none
+  Primitive *sampleEmitter(float u, float &pmf) const;
+  // Chance of sampleEmitter picking this primitive, zero if it emits nothing
+  float emitterPmf(const Primitive *primitive) const;
+  // Loads an OBJ, or a .scene file from scene_convert through LoadSceneFile
   void LoadModel(std::string path);
+  // Maps a file from scene_convert and builds the scene straight from its
+  // tables, exiting with a message if it isn't one this version can read
+  void LoadSceneFile(std::string path);
   void LoadTest();
 
  private:
-  BVH *bvh = NULL;
+  AccelerationStructure *bvh = NULL;
+  // Under the top level structure when there are instances: the geometry in
+  // objects, and one structure per distinct mesh
+  AccelerationStructure *worldBVH = NULL;
+  std::map<Object *, AccelerationStructure *> meshBVHs;
+  BVHType bvhType = BVH_WIDE;
+  AliasTable emitterTable;
+  std::unordered_map<const Primitive *, uint32_t> emitterIndex;
+  // Triangles of scene files, allocated together a file at a time
+  std::vector<std::vector<Triangle>> triangleBlocks;
+  bool inTriangleBlock(const Primitive *primitive) const;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <stdint.h>
+#include <string>
+
+/* Flat binary scene, converted from an OBJ and its MTL files by scene_convert
+ * and mapped straight into memory by Scene::LoadSceneFile, so that nothing is
+ * parsed at load time. After the header come these tables, each an array of
+ * the structs below at a 16 byte aligned offset:
+ *   vertices   every distinct position, normal and uv of the model
+ *   triangles  three vertex indices and a material each, grouped by shape
+ *   shapes     the first triangle of every shape, and the triangle count
+ *   materials  MTL materials, with textures as offsets into the strings
+ *   strings    NUL terminated texture paths relative to the scene file */
+
+const char sceneFileMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+// Bump whenever the layout of the file changes
+const uint32_t sceneFileVersion = 1;
+const uint32_t sceneFileNoTexture = 0xffffffff;
+
+struct SceneFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t vertexCount;
+  uint32_t triangleCount;
+  uint32_t shapeCount;
+  uint32_t materialCount;
+  uint32_t stringBytes;
+  uint64_t vertexOffset;
+  uint64_t triangleOffset;
+  uint64_t shapeOffset;
+  uint64_t materialOffset;
+  uint64_t stringOffset;
+};
+
+// Normals are zero where the OBJ has none, which triangles replace with their
+// face normal
+struct SceneFileVertex {
+  float position[3];
+  float normal[3];
+  float uv[2];
+};
+
+struct SceneFileTriangle {
+  uint32_t vertex[3];
+  uint32_t material;
+};
+
+enum SceneFileTexture {
+  TEXTURE_AMBIENT,
+  TEXTURE_DIFFUSE,
+  TEXTURE_SPECULAR,
+  TEXTURE_SPECULAR_HIGHLIGHT,
+  TEXTURE_BUMP,
+  TEXTURE_DISPLACEMENT,
+  TEXTURE_ALPHA,
+  TEXTURE_REFLECTION,
+  TEXTURE_COUNT
+};
+
+struct SceneFileMaterial {
+  float ambient[3];
+  float diffuse[3];
+  float specular[3];
+  float transmittance[3];
+  float emission[3];
+  float shininess;
+  float refractiveIndex;
+  float dissolve;
+  // Offsets into the string table, or sceneFileNoTexture
+  uint32_t textures[TEXTURE_COUNT];
+};
+
+// Writes the OBJ at objPath, and the MTL files it uses, to a scene file.
+// Returns false with a message in error if either can't be done.
+bool ConvertObjToSceneFile(const std::string &objPath,
+                           const std::string &scenePath, std::string &error);
+
+#endif
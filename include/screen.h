@@ -13,14 +13,28 @@ typedef struct {
   int width;
   bool accumulate;
   glm::vec3 *pixels;
+  // Rasteriser: 1/z of the closest fragment. Raytracer: distance to the first
+  // hit, which guides the denoiser along with the two buffers below.
   float *depthBuffer;
+  glm::vec3 *albedo;
+  glm::vec3 *normals;
+  // Filtered image, shown instead of pixels once the denoiser has run
+  glm::vec3 *denoised;
   int samples;
+  // Raytracer only: samples accumulated into each pixel, and the sum of their
+  // squares to estimate how noisy the pixel still is
+  uint32_t *sampleCounts;
+  glm::vec3 *pixelSquares;
 } screen;
 
 screen *createScreen(std::string type, int width, int height);
 screen *InitializeSDL(std::string type, int width, int height, bool fullscreen = false);
 bool NoQuitMessageSDL();
 void PutPixelSDL(screen *s, int x, int y, glm::vec3 color, float SorD);
+// Standard error of a raytraced pixel's displayed mean, in its noisiest channel
+float PixelError(screen *s, int x, int y);
+void PutFeaturesSDL(screen *s, int x, int y, glm::vec3 albedo, glm::vec3 normal,
+                    float depth);
 void SDL_Renderframe(screen *s);
 void KillSDL(screen *s);
 void SDL_SaveImage(screen *s, const char *filename);
@@ -0,0 +1,85 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <immintrin.h>
+#include <stdint.h>
+
+// Thin wrapper over the widest float vector the target supports. With
+// -march=native on an AVX machine this is 8 lanes, otherwise SSE's 4. Masks
+// are kept as vfloat with all bits of a lane set, like the intrinsics do.
+
+#ifdef __AVX__
+
+#define SIMD_WIDTH 8
+
+struct vfloat {
+  __m256 v;
+  vfloat() {}
+  vfloat(__m256 v) : v(v) {}
+  explicit vfloat(float f) : v(_mm256_set1_ps(f)) {}
+  static vfloat load(const float* p) { return _mm256_load_ps(p); }
+  static vfloat loadu(const float* p) { return _mm256_loadu_ps(p); }
+  void store(float* p) const { _mm256_store_ps(p, v); }
+  void storeu(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm256_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm256_or_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+}
+inline vfloat operator<=(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);
+}
+inline vfloat operator>(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ);
+}
+inline vfloat operator>=(vfloat a, vfloat b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ);
+}
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) {
+  return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+inline int movemask(vfloat mask) { return _mm256_movemask_ps(mask.v); }
+
+#else
+
+#define SIMD_WIDTH 4
+
+struct vfloat {
+  __m128 v;
+  vfloat() {}
+  vfloat(__m128 v) : v(v) {}
+  explicit vfloat(float f) : v(_mm_set1_ps(f)) {}
+  static vfloat load(const float* p) { return _mm_load_ps(p); }
+  static vfloat loadu(const float* p) { return _mm_loadu_ps(p); }
+  void store(float* p) const { _mm_store_ps(p, v); }
+  void storeu(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm_or_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) {
+  return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int movemask(vfloat mask) { return _mm_movemask_ps(mask.v); }
+
+#endif
+
+#endif
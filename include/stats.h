@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <iostream>
+
+// Comment out to compile every counter away
+#define RENDER_STATS
+
+enum StatCounter {
+  STAT_NODES_VISITED,
+  STAT_PRIMITIVES_TESTED,
+  STAT_CAMERA_RAYS,
+  STAT_SHADOW_RAYS,
+  STAT_DIFFUSE_RAYS,
+  STAT_SPECULAR_RAYS,
+  STAT_REFRACTION_RAYS,
+  // Paths started at a camera ray's first hit, the hits along them, and how
+  // many were ended by Russian roulette
+  STAT_PATHS,
+  STAT_PATH_VERTICES,
+  STAT_ROULETTE_TERMINATIONS,
+  STAT_COUNT
+};
+
+/* One thread's counters. Every thread increments its own copy without atomics
+ * or locks, and the copies are cache line aligned so that no two threads ever
+ * write to the same line. Copies register themselves when a thread first
+ * touches them, and fold their counts into a shared total when it exits. */
+struct alignas(64) ThreadStats {
+  uint64_t counters[STAT_COUNT];
+
+  ThreadStats();
+  ~ThreadStats();
+};
+
+// Counters of every thread summed over one frame
+struct FrameStats {
+  uint64_t counters[STAT_COUNT];
+  double seconds;
+
+  void print(std::ostream &out) const;
+  // A single line JSON object
+  void writeJson(std::ostream &out) const;
+};
+
+#ifdef RENDER_STATS
+extern thread_local ThreadStats threadStats;
+#define STAT_ADD(counter, n) (threadStats.counters[counter] += (n))
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+// Counts gained since the last call, which must come between frames while no
+// other thread is rendering
+FrameStats CollectFrameStats(double seconds);
+
+// Tallies of one traversal, kept in registers and added to the thread's
+// counters in one go when the query returns
+struct TraversalStats {
+  uint32_t nodes = 0;
+  uint32_t primitives = 0;
+
+  ~TraversalStats() {
+    STAT_ADD(STAT_NODES_VISITED, nodes);
+    STAT_ADD(STAT_PRIMITIVES_TESTED, primitives);
+  }
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "aligned_allocator.h"
+
+enum TileOrder { TILE_ORDER_SCANLINE, TILE_ORDER_MORTON, TILE_ORDER_HILBERT };
+
+// Block of pixels rendered as one unit of work, in screen coordinates
+struct Tile {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+/* Splits the screen into tiles, ordered along a space filling curve so that
+ * consecutive tiles are close together. Every thread is dealt a contiguous run
+ * of the curve and works through it from the front of its own deque. Threads
+ * that run dry steal from the back of someone else's, which takes the tiles
+ * furthest from what the owner is working on. */
+class TileScheduler {
+ public:
+  TileScheduler(int width, int height, int tileSize,
+                TileOrder order = TILE_ORDER_HILBERT);
+  // Render every tile once, using all OpenMP threads
+  void run(const std::function<void(const Tile &)> &render);
+  // Timings of the last run: slowest and mean tile, steals and the fraction of
+  // the frame the threads spent rendering
+  void printStats(std::ostream &out) const;
+
+  std::vector<Tile> tiles;
+
+ private:
+  struct alignas(64) WorkQueue {
+    std::mutex lock;
+    std::deque<uint32_t> tiles;
+    double busyTime;
+    uint32_t steals;
+  };
+
+  std::vector<WorkQueue, AlignedAllocator<WorkQueue>> queues;
+  std::vector<double> tileTimes;
+  double frameTime = 0;
+
+  bool pop(uint32_t thread, uint32_t &tile);
+  bool steal(uint32_t thread, uint32_t &tile);
+};
+
+#endif
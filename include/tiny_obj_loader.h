@@ -327,6 +327,8 @@ class MaterialStreamReader : public MaterialReader {
 /// directory.
 /// 'triangulate' is optional, and used whether triangulate polygon face in .obj
 /// or not.
+/// The file is memory mapped and split at line breaks into chunks that are
+/// parsed in parallel with OpenMP, then merged with their indices fixed up.
 bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
              std::vector<material_t> *materials, std::string *err,
              const char *filename, const char *mtl_basedir = NULL,
@@ -7,7 +7,8 @@
 // -1 <= x <= +1
 // -1 <= y <= +1
 // -1 <= z <= +1
-void LoadTestModel(std::vector<Object *> &scene) {
+void LoadTestModel(std::vector<Object *> &scene,
+                   std::vector<Material> &materials) {
   using glm::vec3;
   using glm::vec4;
 
@@ -87,18 +88,34 @@ void LoadTestModel(std::vector<Object *> &scene) {
   tallBlockMaterial.ambient = vec3(1);
   tallBlockMaterial.diffuse = vec3(1);
 
+  // Primitives refer to materials by their index in materials
+  auto add = [&materials](const Material &material) {
+    materials.push_back(material);
+    return (uint32_t)(materials.size() - 1);
+  };
+  uint32_t sphere1MaterialId = add(sphere1Material);
+  uint32_t sphere2MaterialId = add(sphere2Material);
+  uint32_t lightMaterialId = add(lightMaterial);
+  uint32_t floorMaterialId = add(floorMaterial);
+  uint32_t leftWallMaterialId = add(leftWallMaterial);
+  uint32_t rightWallMaterialId = add(rightWallMaterial);
+  uint32_t ceilingMaterialId = add(ceilingMaterial);
+  uint32_t backWallMaterialId = add(backWallMaterial);
+  uint32_t shortBlockMaterialId = add(shortBlockMaterial);
+  uint32_t tallBlockMaterialId = add(tallBlockMaterial);
+
   // ---------------------------------------------------------------------------
   // Sphere 1
   std::vector<Primitive *> sphere1Primitives;
   sphere1Primitives.push_back(
-      new Sphere(vec4(-0.5, 0.5, -0.5, 1), 0.35f, sphere1Material));
+      new Sphere(vec4(-0.5, 0.5, -0.5, 1), 0.35f, sphere1MaterialId));
   scene.push_back(new Object(sphere1Primitives));
 
   // ---------------------------------------------------------------------------
   // Sphere 2
   std::vector<Primitive *> sphere2Primitives;
   sphere2Primitives.push_back(
-      new Sphere(vec4(0.3, 0.1, -0.4, 1), 0.3f, sphere2Material));
+      new Sphere(vec4(0.3, 0.1, -0.4, 1), 0.3f, sphere2MaterialId));
   scene.push_back(new Object(sphere2Primitives));
 
   // ---------------------------------------------------------------------------
@@ -122,51 +139,51 @@ void LoadTestModel(std::vector<Object *> &scene) {
   lightPrimitives.push_back(new Triangle(
       Vertex(vec4(3.5 * L / 5, 0.99 * L, 1.5 * L / 5, 1)),
       Vertex(vec4(1.5 * L / 5, 0.99 * L, 1.5 * L / 5, 1)),
-      Vertex(vec4(3.5 * L / 5, 0.99 * L, 2.5 * L / 5, 1)), lightMaterial));
+      Vertex(vec4(3.5 * L / 5, 0.99 * L, 2.5 * L / 5, 1)), lightMaterialId));
   lightPrimitives.push_back(new Triangle(
       Vertex(vec4(1.5 * L / 5, 0.99 * L, 1.5 * L / 5, 1)),
       Vertex(vec4(1.5 * L / 5, 0.99 * L, 2.5 * L / 5, 1)),
-      Vertex(vec4(3.5 * L / 5, 0.99 * L, 2.5 * L / 5, 1)), lightMaterial));
+      Vertex(vec4(3.5 * L / 5, 0.99 * L, 2.5 * L / 5, 1)), lightMaterialId));
   scene.push_back(new Object(lightPrimitives));
 
   // Floor:
   std::vector<Primitive *> floorPrimitives;
   floorPrimitives.push_back(
-      new Triangle(Vertex(C), Vertex(B), Vertex(A), floorMaterial));
+      new Triangle(Vertex(C), Vertex(B), Vertex(A), floorMaterialId));
   floorPrimitives.push_back(
-      new Triangle(Vertex(C), Vertex(D), Vertex(B), floorMaterial));
+      new Triangle(Vertex(C), Vertex(D), Vertex(B), floorMaterialId));
   scene.push_back(new Object(floorPrimitives));
 
   // Left wall
   std::vector<Primitive *> leftWallPrimitives;
   leftWallPrimitives.push_back(
-      new Triangle(Vertex(A), Vertex(E), Vertex(C), leftWallMaterial));
+      new Triangle(Vertex(A), Vertex(E), Vertex(C), leftWallMaterialId));
   leftWallPrimitives.push_back(
-      new Triangle(Vertex(C), Vertex(E), Vertex(G), leftWallMaterial));
+      new Triangle(Vertex(C), Vertex(E), Vertex(G), leftWallMaterialId));
   scene.push_back(new Object(leftWallPrimitives));
 
   // Right wall
   std::vector<Primitive *> rightWallPrimitives;
   rightWallPrimitives.push_back(
-      new Triangle(Vertex(F), Vertex(B), Vertex(D), rightWallMaterial));
+      new Triangle(Vertex(F), Vertex(B), Vertex(D), rightWallMaterialId));
   rightWallPrimitives.push_back(
-      new Triangle(Vertex(H), Vertex(F), Vertex(D), rightWallMaterial));
+      new Triangle(Vertex(H), Vertex(F), Vertex(D), rightWallMaterialId));
   scene.push_back(new Object(rightWallPrimitives));
 
   // Ceiling
   std::vector<Primitive *> ceilingPrimitives;
   ceilingPrimitives.push_back(
-      new Triangle(Vertex(E), Vertex(F), Vertex(G), ceilingMaterial));
+      new Triangle(Vertex(E), Vertex(F), Vertex(G), ceilingMaterialId));
   ceilingPrimitives.push_back(
-      new Triangle(Vertex(F), Vertex(H), Vertex(G), ceilingMaterial));
+      new Triangle(Vertex(F), Vertex(H), Vertex(G), ceilingMaterialId));
   scene.push_back(new Object(ceilingPrimitives));
 
   // Back wall
   std::vector<Primitive *> backWallPrimitives;
   backWallPrimitives.push_back(
-      new Triangle(Vertex(G), Vertex(D), Vertex(C), backWallMaterial));
+      new Triangle(Vertex(G), Vertex(D), Vertex(C), backWallMaterialId));
   backWallPrimitives.push_back(
-      new Triangle(Vertex(G), Vertex(H), Vertex(D), backWallMaterial));
+      new Triangle(Vertex(G), Vertex(H), Vertex(D), backWallMaterialId));
   scene.push_back(new Object(backWallPrimitives));
 
   // ---------------------------------------------------------------------------
@@ -185,33 +202,33 @@ void LoadTestModel(std::vector<Object *> &scene) {
   std::vector<Primitive *> shortBlockPrimitives;
   // Front
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(E), Vertex(B), Vertex(A), shortBlockMaterial));
+      new Triangle(Vertex(E), Vertex(B), Vertex(A), shortBlockMaterialId));
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(E), Vertex(F), Vertex(B), shortBlockMaterial));
+      new Triangle(Vertex(E), Vertex(F), Vertex(B), shortBlockMaterialId));
 
   // Front
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(F), Vertex(D), Vertex(B), shortBlockMaterial));
+      new Triangle(Vertex(F), Vertex(D), Vertex(B), shortBlockMaterialId));
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(F), Vertex(H), Vertex(D), shortBlockMaterial));
+      new Triangle(Vertex(F), Vertex(H), Vertex(D), shortBlockMaterialId));
 
   // BACK
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(H), Vertex(C), Vertex(D), shortBlockMaterial));
+      new Triangle(Vertex(H), Vertex(C), Vertex(D), shortBlockMaterialId));
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(H), Vertex(G), Vertex(C), shortBlockMaterial));
+      new Triangle(Vertex(H), Vertex(G), Vertex(C), shortBlockMaterialId));
 
   // LEFT
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(G), Vertex(E), Vertex(C), shortBlockMaterial));
+      new Triangle(Vertex(G), Vertex(E), Vertex(C), shortBlockMaterialId));
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(E), Vertex(A), Vertex(C), shortBlockMaterial));
+      new Triangle(Vertex(E), Vertex(A), Vertex(C), shortBlockMaterialId));
 
   // TOP
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(G), Vertex(F), Vertex(E), shortBlockMaterial));
+      new Triangle(Vertex(G), Vertex(F), Vertex(E), shortBlockMaterialId));
   shortBlockPrimitives.push_back(
-      new Triangle(Vertex(G), Vertex(H), Vertex(F), shortBlockMaterial));
+      new Triangle(Vertex(G), Vertex(H), Vertex(F), shortBlockMaterialId));
   scene.push_back(new Object(shortBlockPrimitives));
 
   // ---------------------------------------------------------------------------
@@ -229,24 +246,24 @@ void LoadTestModel(std::vector<Object *> &scene) {
 
   std::vector<Primitive *> tallBlockPrimitives;
   // Front
-  tallBlockPrimitives.push_back(new Triangle(E, B, A, tallBlockMaterial));
-  tallBlockPrimitives.push_back(new Triangle(E, F, B, tallBlockMaterial));
+  tallBlockPrimitives.push_back(new Triangle(E, B, A, tallBlockMaterialId));
+  tallBlockPrimitives.push_back(new Triangle(E, F, B, tallBlockMaterialId));
 
   // Front
-  tallBlockPrimitives.push_back(new Triangle(F, D, B, tallBlockMaterial));
-  tallBlockPrimitives.push_back(new Triangle(F, H, D, tallBlockMaterial));
+  tallBlockPrimitives.push_back(new Triangle(F, D, B, tallBlockMaterialId));
+  tallBlockPrimitives.push_back(new Triangle(F, H, D, tallBlockMaterialId));
 
   // BACK
-  tallBlockPrimitives.push_back(new Triangle(H, C, D, tallBlockMaterial));
-  tallBlockPrimitives.push_back(new Triangle(H, G, C, tallBlockMaterial));
+  tallBlockPrimitives.push_back(new Triangle(H, C, D, tallBlockMaterialId));
+  tallBlockPrimitives.push_back(new Triangle(H, G, C, tallBlockMaterialId));
 
   // LEFT
-  tallBlockPrimitives.push_back(new Triangle(G, E, C, tallBlockMaterial));
-  tallBlockPrimitives.push_back(new Triangle(E, A, C, tallBlockMaterial));
+  tallBlockPrimitives.push_back(new Triangle(G, E, C, tallBlockMaterialId));
+  tallBlockPrimitives.push_back(new Triangle(E, A, C, tallBlockMaterialId));
 
   // TOP
-  tallBlockPrimitives.push_back(new Triangle(G, F, E, tallBlockMaterial));
-  tallBlockPrimitives.push_back(new Triangle(G, H, F, tallBlockMaterial));
+  tallBlockPrimitives.push_back(new Triangle(G, F, E, tallBlockMaterialId));
+  tallBlockPrimitives.push_back(new Triangle(G, H, F, tallBlockMaterialId));
   scene.push_back(new Object(tallBlockPrimitives));
 
   // ----------------------------------------------
@@ -0,0 +1,46 @@
+#include "alias_table.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void AliasTable::build(const vector<float> &weights) {
+  uint32_t n = weights.size();
+  bins.assign(n, Bin());
+  probabilities.assign(n, 0.f);
+  if (n == 0) return;
+
+  double sum = 0;
+  for (float weight : weights) sum += weight;
+
+  // Scale so the average bin holds exactly 1, then pair every under-full bin
+  // with an over-full one that tops it up
+  vector<double> scaled(n);
+  vector<uint32_t> small, large;
+  for (uint32_t i = 0; i < n; i++) {
+    probabilities[i] = sum > 0 ? weights[i] / sum : 1.f / n;
+    scaled[i] = (double)probabilities[i] * n;
+    (scaled[i] < 1 ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back();
+    uint32_t l = large.back();
+    small.pop_back();
+    large.pop_back();
+    bins[s].threshold = scaled[s];
+    bins[s].alias = l;
+    scaled[l] -= 1 - scaled[s];
+    (scaled[l] < 1 ? small : large).push_back(l);
+  }
+  // Whatever is left is 1 up to rounding error
+  for (uint32_t i : small) bins[i] = {1.f, i};
+  for (uint32_t i : large) bins[i] = {1.f, i};
+}
+
+uint32_t AliasTable::sample(float u, float &pmf) const {
+  float scaled = u * bins.size();
+  uint32_t i = min((uint32_t)scaled, (uint32_t)bins.size() - 1);
+  uint32_t index = scaled - i < bins[i].threshold ? i : bins[i].alias;
+  pmf = probabilities[index];
+  return index;
+}
@@ -0,0 +1,451 @@
+#include <math.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <functional>
+#include <glm/glm.hpp>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aligned_allocator.h"
+#include "camera.h"
+#include "integrator.h"
+#include "sampler.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "simd.h"
+
+using namespace std;
+using glm::mat4;
+using glm::vec2;
+using glm::vec3;
+using glm::vec4;
+
+/* Ray throughput benchmark. Every scene is traced with a fixed set of rays
+ * built up front from the raytracer's camera, so only the traversal and
+ * shading are timed:
+ *   primary         camera rays, one at a time
+ *   primary_packet  camera rays in 8x8 tiles, as DrawTile traces them
+ *   shadow          occlusion rays from primary hits to sampled emitters
+ *   secondary       rays from primary hits in uniformly random directions
+ *   path            full path samples through Light
+ * Results are written as JSON so runs can be diffed between changes. */
+
+#define BENCH_TILE_SIZE 8
+
+struct BenchSettings {
+  int width = 256;
+  int height = 256;
+  // Each kernel is repeated until it has run for at least this long
+  double minTime = 0.5;
+  vector<int> threads;
+  vector<string> scenes;
+  // Opened while parsing the arguments, so a path that can't be written
+  // fails before any scene runs
+  string output;
+  ofstream outputFile;
+};
+
+struct BenchResult {
+  string scene;
+  string kernel;
+  int threads;
+  uint64_t count;
+  double seconds;
+};
+
+// Traces items [first, last) of a workload during the given repetition of it
+typedef function<void(uint32_t first, uint32_t last, uint32_t repetition)>
+    Kernel;
+
+// Fixed workload for one scene
+struct RaySet {
+  vector<Ray> primary;
+  vector<RayPacket, AlignedAllocator<RayPacket>> packets;
+  vector<Ray> shadow;
+  vector<float> shadowDistances;
+  vector<Ray> secondary;
+};
+
+static void printUsage(const char *program, ostream &out) {
+  out << "Usage: " << program
+      << " [options] [scene.obj | test | instanced]...\n"
+      << "  --threads N,N,...   thread counts to run (default powers of two\n"
+      << "                      up to the number of processors)\n"
+      << "  --min-time SECONDS  time spent on each measurement (default 0.5)\n"
+      << "  --width N           camera rays across (default 256)\n"
+      << "  --height N          camera rays down (default 256)\n"
+      << "  --bvh TYPE          octree, sah or wide (default wide)\n"
+      << "  -o, --output FILE   write the JSON here instead of stdout\n"
+      << "Without scenes the built in cornell box, the same box with its\n"
+      << "objects instanced, models/cornell/cornell.obj and\n"
+      << "models/camping/model-triangulated.obj are run.\n";
+}
+
+static bool parseArguments(int argc, char *argv[], BenchSettings &bench) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(arg, "--threads") && hasValue) {
+      stringstream list(argv[++i]);
+      string count;
+      while (getline(list, count, ',')) {
+        int threads = atoi(count.c_str());
+        if (threads < 1) return false;
+        bench.threads.push_back(threads);
+      }
+    } else if (!strcmp(arg, "--min-time") && hasValue) {
+      bench.minTime = atof(argv[++i]);
+    } else if (!strcmp(arg, "--width") && hasValue) {
+      bench.width = atoi(argv[++i]);
+    } else if (!strcmp(arg, "--height") && hasValue) {
+      bench.height = atoi(argv[++i]);
+    } else if (!strcmp(arg, "--bvh") && hasValue) {
+      const char *type = argv[++i];
+      if (!strcmp(type, "octree")) {
+        settings.bvhType = BVH_OCTREE;
+      } else if (!strcmp(type, "sah")) {
+        settings.bvhType = BVH_SAH;
+      } else if (!strcmp(type, "wide")) {
+        settings.bvhType = BVH_WIDE;
+      } else {
+        return false;
+      }
+    } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && hasValue) {
+      bench.output = argv[++i];
+    } else if (arg[0] == '-') {
+      return false;
+    } else {
+      bench.scenes.push_back(arg);
+    }
+  }
+
+  if (bench.width < BENCH_TILE_SIZE || bench.height < BENCH_TILE_SIZE ||
+      bench.minTime <= 0) {
+    return false;
+  }
+  if (bench.threads.empty()) {
+    int processors = omp_get_num_procs();
+    for (int threads = 1; threads < processors; threads *= 2) {
+      bench.threads.push_back(threads);
+    }
+    bench.threads.push_back(processors);
+  }
+  if (bench.scenes.empty()) {
+    bench.scenes.push_back("test");
+    bench.scenes.push_back("instanced");
+    bench.scenes.push_back("models/cornell/cornell.obj");
+    bench.scenes.push_back("models/camping/model-triangulated.obj");
+  }
+  if (!bench.output.empty()) {
+    bench.outputFile.open(bench.output.c_str());
+    if (!bench.outputFile) {
+      cerr << "Can't write to " << bench.output << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Camera rays in tile order, so that every run of 64 is one packet
+static void buildPrimaryRays(const BenchSettings &bench, Camera &camera,
+                             RaySet &rays) {
+  mat4 rotation = camera.getRotationMatrix();
+  for (int tileY = 0; tileY + BENCH_TILE_SIZE <= bench.height;
+       tileY += BENCH_TILE_SIZE) {
+    for (int tileX = 0; tileX + BENCH_TILE_SIZE <= bench.width;
+         tileX += BENCH_TILE_SIZE) {
+      RayPacket packet;
+      for (int y = tileY; y < tileY + BENCH_TILE_SIZE; y++) {
+        for (int x = tileX; x < tileX + BENCH_TILE_SIZE; x++) {
+          vec4 direction = glm::normalize(
+              vec4((float)(x - bench.width / 2), (float)(y - bench.height / 2),
+                   camera.focalLength, 1) *
+              rotation);
+          Ray ray;
+          ray.position = camera.position + direction * 1e-4f;
+          ray.direction = direction;
+          rays.primary.push_back(ray);
+          packet.add(ray);
+        }
+      }
+      rays.packets.push_back(packet);
+    }
+  }
+}
+
+// Shadow and secondary rays leave from wherever the primary rays landed
+static void buildSecondaryRays(RaySet &rays) {
+  PCGSampler sampler;
+  for (uint32_t i = 0; i < rays.primary.size(); i++) {
+    Intersection hit;
+    if (!scene->intersect(rays.primary[i], hit)) continue;
+    sampler.startSample(i, 0, 0);
+
+    // Scenes without emitters are lit by the raytracer's old point light
+    float pmf;
+    Primitive *light = scene->sampleEmitter(sampler.get1D(), pmf);
+    vec4 lightPos = light != NULL ? light->randomPoint(sampler.get2D())
+                                  : vec4(0, -0.5, -0.7, 1);
+    if (!scene->material(hit.primitive).isLight()) {
+      vec4 lightVec = lightPos - hit.position;
+      float lightDist = glm::length(lightVec);
+      Ray ray;
+      ray.direction = lightVec / lightDist;
+      ray.position = hit.position + ray.direction * 1e-4f;
+      rays.shadow.push_back(ray);
+      rays.shadowDistances.push_back(lightDist - 2e-4f);
+    }
+
+    vec2 u = sampler.get2D();
+    float z = 1 - 2 * u.x;
+    float r = sqrtf(max(0.f, 1 - z * z));
+    float phi = 2 * M_PI * u.y;
+    Ray ray;
+    ray.direction = vec4(r * cosf(phi), r * sinf(phi), z, 0);
+    ray.position = hit.position + ray.direction * 1e-4f;
+    rays.secondary.push_back(ray);
+  }
+}
+
+/* Runs kernel over [first, last) ranges covering count items on the given
+ * number of threads, repeating the whole set until minTime has passed. Work is
+ * handed out in chunks of 64 so the dispatch cost stays out of the numbers.
+ * The kernel is also told which repetition it is part of. */
+static BenchResult measure(const string &sceneName, const string &kernelName,
+                           int threads, uint32_t count, double minTime,
+                           const Kernel &kernel) {
+  const uint32_t chunkSize = 64;
+  const int chunkCount = (count + chunkSize - 1) / chunkSize;
+  BenchResult result;
+  result.scene = sceneName;
+  result.kernel = kernelName;
+  result.threads = threads;
+  result.count = 0;
+  uint32_t repetition = 0;
+  double start = omp_get_wtime();
+  do {
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+      uint32_t first = chunk * chunkSize;
+      kernel(first, min(first + chunkSize, count), repetition);
+    }
+    repetition++;
+    result.count += count;
+    result.seconds = omp_get_wtime() - start;
+  } while (result.seconds < minTime);
+  cerr << "  " << kernelName << ", " << threads << " threads: "
+       << result.count / result.seconds / 1e6 << " M/s" << endl;
+  return result;
+}
+
+static void runScene(const BenchSettings &bench, const string &path,
+                     vector<BenchResult> &results, ostream &sceneJson) {
+  cerr << path << endl;
+  scene = new Scene();
+  double start = omp_get_wtime();
+  if (path == "test") {
+    scene->LoadTest();
+  } else if (path == "instanced") {
+    // The test scene again with everything but its light made an instance,
+    // to measure what the two level structure costs
+    scene->LoadTest();
+    vector<Object *> lights;
+    for (Object *object : scene->objects) {
+      bool emissive = false;
+      for (Primitive *primitive : object->primitives) {
+        emissive |= scene->material(primitive).isLight();
+      }
+      if (emissive) {
+        lights.push_back(object);
+      } else {
+        scene->addInstance(object, mat4(1));
+      }
+    }
+    scene->objects = lights;
+  } else {
+    scene->LoadModel(path);
+  }
+  double loadTime = omp_get_wtime() - start;
+
+  // OBJ models are also converted to a scene file, to compare loading that
+  double sceneFileLoadTime = -1;
+  const string obj = ".obj";
+  if (path.size() > obj.size() &&
+      path.compare(path.size() - obj.size(), obj.size(), obj) == 0) {
+    char scenePath[] = "/tmp/bench-scene-XXXXXX";
+    int fd = mkstemp(scenePath);
+    string error;
+    if (fd >= 0) {
+      close(fd);
+      if (ConvertObjToSceneFile(path, scenePath, error)) {
+        Scene converted;
+        start = omp_get_wtime();
+        converted.LoadSceneFile(scenePath);
+        sceneFileLoadTime = omp_get_wtime() - start;
+      }
+      unlink(scenePath);
+    }
+  }
+
+  uint32_t primitiveCount = 0;
+  for (Object *object : scene->objects) {
+    primitiveCount += object->primitives.size();
+  }
+  for (Instance *instance : scene->instances) {
+    primitiveCount += instance->mesh->primitives.size();
+  }
+
+  // The structure is built once for every thread count to see how the build
+  // scales
+  double buildTime = 0;
+  int defaultThreads = omp_get_max_threads();
+  for (int threads : bench.threads) {
+    omp_set_num_threads(threads);
+    start = omp_get_wtime();
+    scene->createBVH(settings.bvhType);
+    buildTime = omp_get_wtime() - start;
+    BenchResult result;
+    result.scene = path;
+    result.kernel = "build";
+    result.threads = threads;
+    result.count = primitiveCount;
+    result.seconds = buildTime;
+    results.push_back(result);
+    cerr << "  build, " << threads << " threads: "
+         << buildTime * 1000 / max(primitiveCount / 1e6, 1e-6)
+         << " ms per million primitives" << endl;
+  }
+  omp_set_num_threads(defaultThreads);
+  // Then written to a cache file and loaded back, which is what later runs
+  // of an unchanged scene pay instead. The kernels trace the loaded tree.
+  double cacheTime = -1;
+  if (scene->instances.empty() && settings.bvhType != BVH_OCTREE) {
+    char cachePath[] = "/tmp/bench-bvh-XXXXXX";
+    int fd = mkstemp(cachePath);
+    if (fd >= 0) {
+      close(fd);
+      scene->createBVH(settings.bvhType, cachePath);
+      start = omp_get_wtime();
+      scene->createBVH(settings.bvhType, cachePath);
+      cacheTime = omp_get_wtime() - start;
+      unlink(cachePath);
+    }
+  }
+  // Nothing has moved, so this is the bare cost of refitting every node
+  start = omp_get_wtime();
+  scene->updateBVH();
+  double refitTime = omp_get_wtime() - start;
+
+  sceneJson << "    {\"scene\": \"" << path
+            << "\", \"primitives\": " << primitiveCount
+            << ", \"emitters\": " << scene->emitters.size()
+            << ", \"load_ms\": " << loadTime * 1000;
+  if (sceneFileLoadTime >= 0) {
+    sceneJson << ", \"scene_file_load_ms\": " << sceneFileLoadTime * 1000;
+  }
+  sceneJson << ", \"build_ms\": " << buildTime * 1000
+            << ", \"build_ms_per_mtri\": "
+            << buildTime * 1000 / max(primitiveCount / 1e6, 1e-6);
+  if (cacheTime >= 0) {
+    sceneJson << ", \"cache_load_ms\": " << cacheTime * 1000;
+  }
+  sceneJson << ", \"refit_ms\": " << refitTime * 1000 << "}";
+
+  Camera camera(vec4(0, 0, -3.001, 1), vec3(0, 0, 0), bench.height, 0.001,
+                0.001);
+  RaySet rays;
+  buildPrimaryRays(bench, camera, rays);
+  buildSecondaryRays(rays);
+
+  for (int threads : bench.threads) {
+    results.push_back(measure(
+        path, "primary", threads, rays.primary.size(), bench.minTime,
+        [&rays](uint32_t first, uint32_t last, uint32_t) {
+          for (uint32_t i = first; i < last; i++) {
+            Intersection hit;
+            scene->intersect(rays.primary[i], hit);
+          }
+        }));
+    results.push_back(measure(
+        path, "primary_packet", threads, rays.primary.size(), bench.minTime,
+        [&rays](uint32_t first, uint32_t, uint32_t) {
+          // Chunks are exactly one packet wide
+          Intersection hits[RayPacket::maxSize];
+          scene->intersect(rays.packets[first / RayPacket::maxSize], hits);
+        }));
+    results.push_back(measure(
+        path, "shadow", threads, rays.shadow.size(), bench.minTime,
+        [&rays](uint32_t first, uint32_t last, uint32_t) {
+          for (uint32_t i = first; i < last; i++) {
+            scene->occluded(rays.shadow[i], rays.shadowDistances[i]);
+          }
+        }));
+    results.push_back(measure(
+        path, "secondary", threads, rays.secondary.size(), bench.minTime,
+        [&rays](uint32_t first, uint32_t last, uint32_t) {
+          for (uint32_t i = first; i < last; i++) {
+            Intersection hit;
+            scene->intersect(rays.secondary[i], hit);
+          }
+        }));
+    results.push_back(measure(
+        path, "path", threads, rays.primary.size(), bench.minTime,
+        [&rays, &camera](uint32_t first, uint32_t last, uint32_t repetition) {
+          // Each repetition is a new sample of every pixel
+          SobolSampler sampler;
+          for (uint32_t i = first; i < last; i++) {
+            sampler.startSample(i, 0, repetition);
+            Light(camera.position, rays.primary[i].direction, sampler);
+          }
+        }));
+  }
+  delete scene;
+}
+
+int main(int argc, char *argv[]) {
+  BenchSettings bench;
+  if (!parseArguments(argc, argv, bench)) {
+    printUsage(argv[0], cerr);
+    return 1;
+  }
+
+  vector<BenchResult> results;
+  stringstream sceneJson;
+  for (uint32_t i = 0; i < bench.scenes.size(); i++) {
+    if (i > 0) sceneJson << ",\n";
+    runScene(bench, bench.scenes[i], results, sceneJson);
+  }
+
+  ostream &out = bench.output.empty() ? cout : bench.outputFile;
+  out << "{\n"
+      << "  \"processors\": " << omp_get_num_procs() << ",\n"
+      << "  \"simd_width\": " << SIMD_WIDTH << ",\n"
+      << "  \"width\": " << bench.width << ",\n"
+      << "  \"height\": " << bench.height << ",\n"
+      << "  \"max_bounces\": " << settings.maxBounces << ",\n"
+      << "  \"bvh\": \"" << BVHTypeName(settings.bvhType) << "\",\n"
+      << "  \"scenes\": [\n"
+      << sceneJson.str() << "\n  ],\n"
+      << "  \"results\": [\n";
+  for (uint32_t i = 0; i < results.size(); i++) {
+    const BenchResult &result = results[i];
+    out << "    {\"scene\": \"" << result.scene << "\", \"kernel\": \""
+        << result.kernel << "\", \"threads\": " << result.threads
+        << ", \"count\": " << result.count
+        << ", \"seconds\": " << result.seconds
+        << ", \"per_second\": " << result.count / result.seconds << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+  out.flush();
+  if (!out) {
+    cerr << "Failed to write the results to "
+         << (bench.output.empty() ? "stdout" : bench.output) << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,10 +1,17 @@
 #include "bvh.h"
+#include "stats.h"
+#include <algorithm>
 #include <atomic>
+#include <cstdlib>
+#include <functional>
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
 
 using namespace std;
+using glm::mat4;
+using glm::vec2;
 using glm::vec3;
+using glm::vec4;
 
 const float rt3b3 = sqrtf(3) / 3.f;
 
@@ -17,6 +24,18 @@ const vec3 planeSetNormals[normalSize] = {vec3(1, 0, 0),
                                           vec3(-rt3b3, -rt3b3, rt3b3),
                                           vec3(rt3b3, -rt3b3, rt3b3)};
 
+const char* BVHTypeName(BVHType type) {
+  switch (type) {
+    case BVH_OCTREE:
+      return "octree";
+    case BVH_SAH:
+      return "sah";
+    case BVH_WIDE:
+      return "wide";
+  }
+  return "unknown";
+}
+
 /* BOUNDING BOX IMPLEMENTATION */
 
 BBox::BBox() {}
@@ -34,7 +53,24 @@ BBox& BBox::extendBy(const vec3& point) {
 
   return *this;
 }
+BBox& BBox::extendBy(const BBox& bbox) {
+  bounds[0] = glm::min(bounds[0], bbox[0]);
+  bounds[1] = glm::max(bounds[1], bbox[1]);
+
+  return *this;
+}
 vec3 BBox::centroid() const { return (bounds[0] + bounds[1]) * 0.5f; }
+float BBox::surfaceArea() const {
+  vec3 d = bounds[1] - bounds[0];
+  if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+  return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+uint8_t BBox::maxExtent() const {
+  vec3 d = bounds[1] - bounds[0];
+  if (d.x > d.y && d.x > d.z) return 0;
+  if (d.y > d.z) return 1;
+  return 2;
+}
 
 bool BBox::intersect(const vec3& start, const vec3& direction, const vec3& sign,
                      float& minDist) const {
@@ -74,6 +110,65 @@ bool BBox::intersect(const vec3& start, const vec3& direction, const vec3& sign,
   return true;
 }
 
+bool BBox::intersect(const vec3& start, const vec3& invDirection,
+                     const int dirIsNeg[3], float& tNear, float& tFar) const {
+  float tmin = (bounds[dirIsNeg[0]].x - start.x) * invDirection.x;
+  float tmax = (bounds[1 - dirIsNeg[0]].x - start.x) * invDirection.x;
+  float tymin = (bounds[dirIsNeg[1]].y - start.y) * invDirection.y;
+  float tymax = (bounds[1 - dirIsNeg[1]].y - start.y) * invDirection.y;
+
+  if ((tmin > tymax) || (tymin > tmax)) return false;
+  if (tymin > tmin) tmin = tymin;
+  if (tymax < tmax) tmax = tymax;
+
+  float tzmin = (bounds[dirIsNeg[2]].z - start.z) * invDirection.z;
+  float tzmax = (bounds[1 - dirIsNeg[2]].z - start.z) * invDirection.z;
+
+  if ((tmin > tzmax) || (tzmin > tmax)) return false;
+  if (tzmin > tmin) tmin = tzmin;
+  if (tzmax < tmax) tmax = tzmax;
+
+  // Clip against the interval the caller is interested in
+  if (tmin > tNear) tNear = tmin;
+  if (tmax < tFar) tFar = tmax;
+
+  return tNear <= tFar;
+}
+
+/* RAY PACKET IMPLEMENTATION */
+
+void RayPacket::add(const Ray& ray) {
+  rays[size] = ray;
+  startX[size] = ray.position.x;
+  startY[size] = ray.position.y;
+  startZ[size] = ray.position.z;
+  invX[size] = 1.f / ray.direction.x;
+  invY[size] = 1.f / ray.direction.y;
+  invZ[size] = 1.f / ray.direction.z;
+  size++;
+}
+
+bool RayPacket::coherent() const {
+  for (uint32_t i = 1; i < size; ++i) {
+    if ((invX[i] < 0) != (invX[0] < 0) || (invY[i] < 0) != (invY[0] < 0) ||
+        (invZ[i] < 0) != (invZ[0] < 0))
+      return false;
+  }
+  return true;
+}
+
+void AccelerationStructure::intersect(const RayPacket& packet,
+                                      Intersection* intersections) const {
+  for (uint32_t i = 0; i < packet.size; ++i) {
+    intersect(packet.rays[i], intersections[i]);
+  }
+}
+
+bool AccelerationStructure::occluded(Ray ray, float maxDistance) const {
+  Intersection intersection;
+  return intersect(ray, intersection) && intersection.distance < maxDistance;
+}
+
 /* EXTENTS IMPLEMENTATION */
 
 BVH::Extents::Extents() {
@@ -233,51 +328,29 @@ void BVH::Octree::build(OctreeNode*& node, const BBox& bbox) {
 /* BVH IMPLEMENTATION */
 
 BVH::BVH(vector<Object*> scene) {
-  Extents sceneExtents;
-  extentsList.reserve(scene.size());
+  // Objects are bounded independently, each by its primitives' own bounds
+  extentsList.resize(scene.size());
+#pragma omp parallel for schedule(dynamic)
   for (uint32_t i = 0; i < scene.size(); ++i) {
-    for (uint32_t ii = 0; ii < scene[i]->primitives.size(); ++ii) {
-      Triangle* tri = dynamic_cast<Triangle*>(scene[i]->primitives[ii]);
-      Sphere* sph = dynamic_cast<Sphere*>(scene[i]->primitives[ii]);
+    for (Primitive* primitive : scene[i]->primitives) {
       for (uint8_t j = 0; j < normalsSize; ++j) {
-        if (tri != nullptr) {
-          float v0d = dot(planeSetNormals[j], vec3(tri->v0.position) +
-                                                  (planeSetNormals[i] * 1e-4f));
-          if (v0d < extentsList[i].slabs[j][0])
-            extentsList[i].slabs[j][0] = v0d;
-          if (v0d > extentsList[i].slabs[j][1])
-            extentsList[i].slabs[j][1] = v0d;
-
-          float v1d = dot(planeSetNormals[j], vec3(tri->v1.position) +
-                                                  (planeSetNormals[i] * 1e-4f));
-          if (v1d < extentsList[i].slabs[j][0])
-            extentsList[i].slabs[j][0] = v1d;
-          if (v1d > extentsList[i].slabs[j][1])
-            extentsList[i].slabs[j][1] = v1d;
-
-          float v2d = dot(planeSetNormals[j], vec3(tri->v2.position) +
-                                                  (planeSetNormals[i] * 1e-4f));
-          if (v2d < extentsList[i].slabs[j][0])
-            extentsList[i].slabs[j][0] = v2d;
-          if (v2d > extentsList[i].slabs[j][1])
-            extentsList[i].slabs[j][1] = v2d;
-        } else if (sph != nullptr) {
-          float p1 = dot(planeSetNormals[j],
-                         vec3(sph->c) + (planeSetNormals[j] * sph->radius));
-          if (p1 < extentsList[i].slabs[j][0]) extentsList[i].slabs[j][0] = p1;
-          if (p1 > extentsList[i].slabs[j][1]) extentsList[i].slabs[j][1] = p1;
-
-          float p2 = dot(planeSetNormals[j],
-                         vec3(sph->c) - (planeSetNormals[j] * sph->radius));
-          if (p2 < extentsList[i].slabs[j][0]) extentsList[i].slabs[j][0] = p2;
-          if (p2 > extentsList[i].slabs[j][1]) extentsList[i].slabs[j][1] = p2;
-        }
+        primitive->computeBounds(planeSetNormals[j],
+                                 extentsList[i].slabs[j][0],
+                                 extentsList[i].slabs[j][1]);
       }
     }
-    sceneExtents.extendBy(extentsList[i]);
+    // Flat objects lying in a slab plane are hit right on its boundary, so
+    // leave some room for rounding
+    for (uint8_t j = 0; j < normalsSize; ++j) {
+      extentsList[i].slabs[j][0] -= 1e-4f;
+      extentsList[i].slabs[j][1] += 1e-4f;
+    }
     extentsList[i].object = scene[i];
   }
 
+  Extents sceneExtents;
+  for (const Extents& extents : extentsList) sceneExtents.extendBy(extents);
+
   octree = new Octree(sceneExtents);
 
   for (uint32_t i = 0; i < scene.size(); ++i) {
@@ -306,11 +379,13 @@ bool BVH::intersect(Ray ray, Intersection& intersection) const {
       tFar < 0)
     return false;
   minDist = tFar;
+  TraversalStats stats;
   std::priority_queue<BVH::Octree::QueueElement> queue;
   queue.push(BVH::Octree::QueueElement(octree->root, 0));
   while (!queue.empty() && queue.top().distance < minDist) {
     const Octree::OctreeNode* node = queue.top().node;
     queue.pop();
+    stats.nodes++;
     if (node->isLeaf) {
       for (const auto& extent : node->nodeExtentsList) {
         Intersection i;
@@ -338,3 +413,1150 @@ bool BVH::intersect(Ray ray, Intersection& intersection) const {
   }
   return intersection.distance != INFINITY && intersection.primitive != nullptr;
 }
+
+/* SAH BVH IMPLEMENTATION */
+
+static_assert(sizeof(SAHBVH::LinearNode) == 32,
+              "two flattened nodes should fill a cache line");
+
+const uint32_t sahBinCount = 16;
+// Relative cost of a node traversal step against a primitive intersection
+const float sahTraversalCost = 0.125f;
+// Subtrees with fewer primitives than this are built by the thread that split
+// them off, as a task would cost more than it saves
+const uint32_t parallelBuildSize = 4096;
+
+static BBox primitiveBounds(Primitive* primitive) {
+  const vec3 axes[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+  BBox bbox;
+  for (uint8_t j = 0; j < 3; ++j) {
+    primitive->computeBounds(axes[j], bbox[0][j], bbox[1][j]);
+  }
+  return bbox;
+}
+
+/* Lists the nodes of a tree rooted at node 0 in breadth first order, along
+ * with where each level starts, so that refits can work up a level at a time
+ * and fit every node of a level in parallel. children appends the interior
+ * children of a node. */
+static void levelOrder(
+    const function<void(uint32_t, vector<uint32_t>&)>& children,
+    vector<uint32_t>& order, vector<uint32_t>& levels) {
+  order.assign(1, 0);
+  levels.clear();
+  for (uint32_t begin = 0; begin < order.size();) {
+    levels.push_back(begin);
+    uint32_t end = order.size();
+    for (uint32_t i = begin; i < end; ++i) children(order[i], order);
+    begin = end;
+  }
+  levels.push_back(order.size());
+}
+
+SAHBVH::SAHBVH(vector<Object*> scene, uint32_t maxLeafSize)
+    : maxLeafSize(maxLeafSize) {
+  for (uint32_t i = 0; i < scene.size(); ++i) {
+    primitives.insert(primitives.end(), scene[i]->primitives.begin(),
+                      scene[i]->primitives.end());
+  }
+
+  if (primitives.empty()) return;
+
+  vector<PrimitiveInfo> primitiveInfo(primitives.size());
+#pragma omp parallel for schedule(static)
+  for (uint32_t i = 0; i < primitives.size(); ++i) {
+    primitiveInfo[i].bbox = primitiveBounds(primitives[i]);
+    primitiveInfo[i].centroid = primitiveInfo[i].bbox.centroid();
+    primitiveInfo[i].index = i;
+  }
+
+  // One thread splits the root and the rest of the team picks up the
+  // subtrees it hands out
+  BuildNode* root;
+#pragma omp parallel
+#pragma omp single
+  root = build(primitiveInfo, 0, primitiveInfo.size(), 0);
+
+  vector<Primitive*> orderedPrimitives(primitives.size());
+#pragma omp parallel for schedule(static)
+  for (uint32_t i = 0; i < primitives.size(); ++i) {
+    orderedPrimitives[i] = primitives[primitiveInfo[i].index];
+  }
+  primitives.swap(orderedPrimitives);
+
+  // The root sits alone at index 0 and index 1 is padding, so that every
+  // sibling pair after it starts on a cache line boundary
+  nodes.reserve(2 * primitives.size() + 1);
+  nodes.resize(2);
+  flatten(root, 0);
+  deleteBuildNode(root);
+  builtCost = sahCost();
+}
+
+void SAHBVH::deleteBuildNode(BuildNode*& node) {
+  for (uint8_t i = 0; i < 2; ++i) {
+    if (node->child[i] != nullptr) {
+      deleteBuildNode(node->child[i]);
+    }
+  }
+  delete node;
+  node = nullptr;
+}
+
+SAHBVH::BuildNode* SAHBVH::build(vector<PrimitiveInfo>& primitiveInfo,
+                                 uint32_t start, uint32_t end,
+                                 uint32_t depth) {
+  BuildNode* node = new BuildNode;
+  BBox centroidBounds;
+  for (uint32_t i = start; i < end; ++i) {
+    node->bbox.extendBy(primitiveInfo[i].bbox);
+    centroidBounds.extendBy(primitiveInfo[i].centroid);
+  }
+
+  uint32_t count = end - start;
+  uint8_t axis = centroidBounds.maxExtent();
+  float axisMin = centroidBounds[0][axis];
+  float axisExtent = centroidBounds[1][axis] - axisMin;
+  node->axis = axis;
+
+  uint32_t mid = start;
+  if (depth + 1 >= maxDepth) {
+    // Traversal uses a fixed size stack so the tree can't get any deeper
+  } else if (count > 1 && axisExtent > 0) {
+    // Split along the axis of largest centroid spread
+    struct Bin {
+      BBox bbox;
+      uint32_t count = 0;
+    } bins[sahBinCount];
+
+    for (uint32_t i = start; i < end; ++i) {
+      uint32_t b = sahBinCount *
+                   ((primitiveInfo[i].centroid[axis] - axisMin) / axisExtent);
+      if (b == sahBinCount) b = sahBinCount - 1;
+      bins[b].count++;
+      bins[b].bbox.extendBy(primitiveInfo[i].bbox);
+    }
+
+    // Sweep from the right to collect the area of every right hand side, then
+    // from the left to evaluate the cost of each of the bin boundaries
+    float rightArea[sahBinCount];
+    uint32_t rightCount[sahBinCount];
+    BBox rightBox;
+    uint32_t rightSum = 0;
+    for (uint32_t b = sahBinCount - 1; b > 0; --b) {
+      rightBox.extendBy(bins[b].bbox);
+      rightSum += bins[b].count;
+      rightArea[b] = rightBox.surfaceArea();
+      rightCount[b] = rightSum;
+    }
+
+    float bestCost = INFINITY;
+    uint32_t bestSplit = 0;
+    BBox leftBox;
+    uint32_t leftSum = 0;
+    for (uint32_t b = 0; b < sahBinCount - 1; ++b) {
+      leftBox.extendBy(bins[b].bbox);
+      leftSum += bins[b].count;
+      if (leftSum == 0 || rightCount[b + 1] == 0) continue;
+      float cost = leftSum * leftBox.surfaceArea() +
+                   rightCount[b + 1] * rightArea[b + 1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestSplit = b;
+      }
+    }
+
+    float nodeArea = node->bbox.surfaceArea();
+    float splitCost = sahTraversalCost +
+                      (nodeArea > 0 ? bestCost / nodeArea : bestCost);
+    if (bestCost != INFINITY &&
+        (count > maxLeafSize || splitCost < (float)count)) {
+      PrimitiveInfo* midInfo = std::partition(
+          &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+          [=](const PrimitiveInfo& info) {
+            uint32_t b = sahBinCount *
+                         ((info.centroid[axis] - axisMin) / axisExtent);
+            if (b == sahBinCount) b = sahBinCount - 1;
+            return b <= bestSplit;
+          });
+      mid = midInfo - &primitiveInfo[0];
+    }
+  } else if (count > maxLeafSize) {
+    // Every centroid coincides so no plane separates them, just halve the list
+    // to keep leaves small
+    mid = start + count / 2;
+  }
+
+  if (mid == start || mid == end) {
+    // Only leaves forced at maxDepth can get this big
+    if (count > maxLeafPrimitives) {
+      cerr << "A BVH leaf at depth " << depth << " would hold " << count
+           << " primitives, more than the " << maxLeafPrimitives
+           << " a node can count" << endl;
+      exit(1);
+    }
+    node->firstPrimitive = start;
+    node->primitiveCount = count;
+    return node;
+  }
+
+  // The two halves are disjoint ranges of primitiveInfo, so they can be built
+  // at the same time. It is shared explicitly as a task would copy it.
+  if (count >= parallelBuildSize) {
+#pragma omp task shared(primitiveInfo)
+    node->child[0] = build(primitiveInfo, start, mid, depth + 1);
+    node->child[1] = build(primitiveInfo, mid, end, depth + 1);
+#pragma omp taskwait
+  } else {
+    node->child[0] = build(primitiveInfo, start, mid, depth + 1);
+    node->child[1] = build(primitiveInfo, mid, end, depth + 1);
+  }
+  return node;
+}
+
+void SAHBVH::flatten(const BuildNode* node, uint32_t offset) {
+  nodes[offset].bbox = node->bbox;
+  nodes[offset].axis = node->axis;
+  if (node->isLeaf()) {
+    nodes[offset].primitivesOffset = node->firstPrimitive;
+    nodes[offset].primitiveCount = node->primitiveCount;
+  } else {
+    uint32_t childOffset = nodes.size();
+    nodes.resize(childOffset + 2);
+    nodes[offset].childOffset = childOffset;
+    nodes[offset].primitiveCount = 0;
+    flatten(node->child[0], childOffset);
+    flatten(node->child[1], childOffset + 1);
+  }
+}
+
+bool SAHBVH::intersect(Ray ray, Intersection& intersection) const {
+  intersection.distance = INFINITY;
+  intersection.primitive = nullptr;
+  if (nodes.empty()) return false;
+
+  vec3 start = vec3(ray.position);
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  float tNear = 0, tFar = INFINITY;
+  if (!nodes[0].bbox.intersect(start, invDirection, dirIsNeg, tNear, tFar))
+    return false;
+
+  float minDist = INFINITY;
+  Primitive* closestPrimitive = nullptr;
+  TraversalStats stats;
+  StackElement stack[maxDepth];
+  uint32_t stackSize = 0;
+  uint32_t current = 0;
+  while (true) {
+    const LinearNode& node = nodes[current];
+    stats.nodes++;
+    if (node.isLeaf()) {
+      stats.primitives += node.primitiveCount;
+      for (uint32_t i = node.primitivesOffset;
+           i < node.primitivesOffset + node.primitiveCount; ++i) {
+        float dist = primitives[i]->intersect(ray);
+        if (dist < minDist) {
+          minDist = dist;
+          closestPrimitive = primitives[i];
+        }
+      }
+    } else {
+      // Both children share a cache line, test them together and descend into
+      // the nearer one first so the far one can be culled by what it finds
+      const LinearNode* children = &nodes[node.childOffset];
+      float nearDist[2] = {0, 0};
+      bool hit[2];
+      for (uint8_t i = 0; i < 2; ++i) {
+        float tFarChild = minDist;
+        hit[i] = children[i].bbox.intersect(start, invDirection, dirIsNeg,
+                                            nearDist[i], tFarChild);
+      }
+      if (hit[0] && hit[1]) {
+        uint8_t first = nearDist[1] < nearDist[0];
+        stack[stackSize].node = node.childOffset + 1 - first;
+        stack[stackSize].distance = nearDist[1 - first];
+        stackSize++;
+        current = node.childOffset + first;
+        continue;
+      } else if (hit[0] || hit[1]) {
+        current = node.childOffset + hit[1];
+        continue;
+      }
+    }
+
+    // Pop the next node that could still hold something closer
+    while (stackSize > 0 && stack[stackSize - 1].distance >= minDist) {
+      stackSize--;
+    }
+    if (stackSize == 0) break;
+    current = stack[--stackSize].node;
+  }
+
+  if (closestPrimitive == nullptr) return false;
+  intersection.primitive = closestPrimitive;
+  intersection.distance = minDist;
+  intersection.position = ray.position + minDist * ray.direction;
+  return true;
+}
+
+bool SAHBVH::occluded(Ray ray, float maxDistance) const {
+  if (nodes.empty()) return false;
+
+  vec3 start = vec3(ray.position);
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  float tNear = 0, tFar = maxDistance;
+  if (!nodes[0].bbox.intersect(start, invDirection, dirIsNeg, tNear, tFar))
+    return false;
+
+  // Any hit will do, so children are visited in storage order
+  TraversalStats stats;
+  uint32_t stack[maxDepth];
+  uint32_t stackSize = 0;
+  uint32_t current = 0;
+  while (true) {
+    const LinearNode& node = nodes[current];
+    stats.nodes++;
+    if (node.isLeaf()) {
+      for (uint32_t i = node.primitivesOffset;
+           i < node.primitivesOffset + node.primitiveCount; ++i) {
+        stats.primitives++;
+        if (primitives[i]->intersect(ray) < maxDistance) return true;
+      }
+    } else {
+      const LinearNode* children = &nodes[node.childOffset];
+      bool hit[2];
+      for (uint8_t i = 0; i < 2; ++i) {
+        float tNearChild = 0, tFarChild = maxDistance;
+        hit[i] = children[i].bbox.intersect(start, invDirection, dirIsNeg,
+                                            tNearChild, tFarChild);
+      }
+      if (hit[0] && hit[1]) {
+        stack[stackSize++] = node.childOffset + 1;
+        current = node.childOffset;
+        continue;
+      } else if (hit[0] || hit[1]) {
+        current = node.childOffset + hit[1];
+        continue;
+      }
+    }
+
+    if (stackSize == 0) break;
+    current = stack[--stackSize];
+  }
+  return false;
+}
+
+bool SAHBVH::refit() {
+  if (nodes.empty()) return true;
+  vector<uint32_t> order, levels;
+  levelOrder(
+      [this](uint32_t node, vector<uint32_t>& out) {
+        if (!nodes[node].isLeaf()) {
+          out.push_back(nodes[node].childOffset);
+          out.push_back(nodes[node].childOffset + 1);
+        }
+      },
+      order, levels);
+
+  for (int level = levels.size() - 2; level >= 0; --level) {
+#pragma omp parallel for schedule(dynamic, 16)
+    for (uint32_t i = levels[level]; i < levels[level + 1]; ++i) {
+      LinearNode& node = nodes[order[i]];
+      BBox bbox;
+      if (node.isLeaf()) {
+        for (uint32_t j = node.primitivesOffset;
+             j < node.primitivesOffset + node.primitiveCount; ++j) {
+          bbox.extendBy(primitiveBounds(primitives[j]));
+        }
+      } else {
+        bbox.extendBy(nodes[node.childOffset].bbox);
+        bbox.extendBy(nodes[node.childOffset + 1].bbox);
+      }
+      node.bbox = bbox;
+    }
+  }
+  return true;
+}
+
+float SAHBVH::sahCost() const {
+  if (nodes.empty()) return 0;
+  float rootArea = nodes[0].bbox.surfaceArea();
+  if (rootArea <= 0) return 0;
+  float cost = 0;
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    if (i == 1) continue;  // padding
+    const LinearNode& node = nodes[i];
+    cost += node.bbox.surfaceArea() *
+            (node.isLeaf() ? node.primitiveCount : sahTraversalCost);
+  }
+  return cost / rootArea;
+}
+
+/* WIDE BVH IMPLEMENTATION */
+
+WideBVH::WideBVH(vector<Object*> scene) {
+  // Leaves are intersected a pack at a time, so let them fill one
+  SAHBVH binary(scene, width);
+  primitives = binary.primitives;
+  if (binary.nodes.empty()) return;
+  collapse(binary, 0);
+  // The triangles are scattered through memory in tree order, so reading them
+  // is most of the work here and is spread over every thread
+#pragma omp parallel for schedule(dynamic, 64)
+  for (uint32_t i = 0; i < packs.size(); ++i) load(packs[i]);
+  builtCost = sahCost();
+}
+
+uint32_t WideBVH::pack(uint32_t firstPrimitive, uint32_t primitiveCount) {
+  uint32_t offset = packs.size();
+  for (uint32_t first = firstPrimitive;
+       first < firstPrimitive + primitiveCount; first += width) {
+    TrianglePack triangles;
+    triangles.scalarMask = 0;
+    for (uint32_t i = 0; i < width; ++i) {
+      triangles.primitive[i] = 0;
+      if (first + i < firstPrimitive + primitiveCount) {
+        triangles.primitive[i] = first + i;
+      }
+      for (uint8_t axis = 0; axis < 3; ++axis) {
+        triangles.v0[axis][i] = 0;
+        triangles.e1[axis][i] = 0;
+        triangles.e2[axis][i] = 0;
+      }
+    }
+    packs.push_back(triangles);
+  }
+  return offset;
+}
+
+void WideBVH::load(TrianglePack& pack) {
+  for (uint32_t i = 0; i < width; ++i) {
+    // Lane 0 is always used, later lanes hold primitives past the first one
+    // or are unused and left at zero
+    if (i > 0 && pack.primitive[i] == 0) continue;
+    Triangle* tri = dynamic_cast<Triangle*>(primitives[pack.primitive[i]]);
+    if (tri == nullptr) {
+      pack.scalarMask |= 1 << i;
+      continue;
+    }
+    vec3 v0 = vec3(tri->v0.position);
+    for (uint8_t axis = 0; axis < 3; ++axis) {
+      pack.v0[axis][i] = v0[axis];
+      pack.e1[axis][i] = tri->e1[axis];
+      pack.e2[axis][i] = tri->e2[axis];
+    }
+  }
+}
+
+uint32_t WideBVH::collapse(const SAHBVH& binary, uint32_t binaryNode) {
+  // Pull grandchildren up into this node, always opening the child with the
+  // largest surface area as it is the one most likely to be hit
+  uint32_t children[width];
+  uint32_t childCount = 0;
+  if (binary.nodes[binaryNode].isLeaf()) {
+    children[childCount++] = binaryNode;
+  } else {
+    children[childCount++] = binary.nodes[binaryNode].childOffset;
+    children[childCount++] = binary.nodes[binaryNode].childOffset + 1;
+    while (childCount < width) {
+      int best = -1;
+      float bestArea = -1;
+      for (uint32_t i = 0; i < childCount; ++i) {
+        const SAHBVH::LinearNode& child = binary.nodes[children[i]];
+        if (!child.isLeaf() && child.bbox.surfaceArea() > bestArea) {
+          bestArea = child.bbox.surfaceArea();
+          best = i;
+        }
+      }
+      if (best < 0) break;
+      uint32_t childOffset = binary.nodes[children[best]].childOffset;
+      children[best] = childOffset;
+      children[childCount++] = childOffset + 1;
+    }
+  }
+
+  uint32_t index = nodes.size();
+  nodes.push_back(Node());
+  for (uint32_t i = 0; i < width; ++i) {
+    for (uint8_t axis = 0; axis < 3; ++axis) {
+      nodes[index].bboxMin[axis][i] = INFINITY;
+      nodes[index].bboxMax[axis][i] = -INFINITY;
+    }
+    nodes[index].offset[i] = 0;
+    nodes[index].packCount[i] = 0;
+  }
+
+  for (uint32_t i = 0; i < childCount; ++i) {
+    const SAHBVH::LinearNode& child = binary.nodes[children[i]];
+    for (uint8_t axis = 0; axis < 3; ++axis) {
+      nodes[index].bboxMin[axis][i] = child.bbox[0][axis];
+      nodes[index].bboxMax[axis][i] = child.bbox[1][axis];
+    }
+    if (child.isLeaf()) {
+      nodes[index].offset[i] =
+          pack(child.primitivesOffset, child.primitiveCount);
+      nodes[index].packCount[i] = (child.primitiveCount + width - 1) / width;
+    } else {
+      // Recursing may grow the node array, so only index into it afterwards
+      uint32_t childIndex = collapse(binary, children[i]);
+      nodes[index].offset[i] = childIndex;
+    }
+  }
+  return index;
+}
+
+void WideBVH::intersect(const TrianglePack& pack, const Ray& ray,
+                        float& minDist, Primitive*& closestPrimitive) const {
+  // Moller-Trumbore on every lane at once
+  const vfloat dirX(ray.direction.x), dirY(ray.direction.y),
+      dirZ(ray.direction.z);
+  const vfloat e1X = vfloat::load(pack.e1[0]), e1Y = vfloat::load(pack.e1[1]),
+               e1Z = vfloat::load(pack.e1[2]);
+  const vfloat e2X = vfloat::load(pack.e2[0]), e2Y = vfloat::load(pack.e2[1]),
+               e2Z = vfloat::load(pack.e2[2]);
+
+  vfloat pX = dirY * e2Z - dirZ * e2Y;
+  vfloat pY = dirZ * e2X - dirX * e2Z;
+  vfloat pZ = dirX * e2Y - dirY * e2X;
+  vfloat det = e1X * pX + e1Y * pY + e1Z * pZ;
+  vfloat valid = (det > vfloat(1e-12f)) | (det < vfloat(-1e-12f));
+  vfloat invDet = vfloat(1.f) / select(valid, det, vfloat(1.f));
+
+  vfloat tX = vfloat(ray.position.x) - vfloat::load(pack.v0[0]);
+  vfloat tY = vfloat(ray.position.y) - vfloat::load(pack.v0[1]);
+  vfloat tZ = vfloat(ray.position.z) - vfloat::load(pack.v0[2]);
+  vfloat u = (tX * pX + tY * pY + tZ * pZ) * invDet;
+
+  vfloat qX = tY * e1Z - tZ * e1Y;
+  vfloat qY = tZ * e1X - tX * e1Z;
+  vfloat qZ = tX * e1Y - tY * e1X;
+  vfloat v = (dirX * qX + dirY * qY + dirZ * qZ) * invDet;
+  vfloat dist = (e2X * qX + e2Y * qY + e2Z * qZ) * invDet;
+
+  const vfloat zero(0.f);
+  valid = valid & (u >= zero) & (v >= zero) & (u + v <= vfloat(1.f)) &
+          (dist > zero) & (dist < vfloat(minDist));
+  int hitMask = movemask(valid);
+
+  if (hitMask != 0) {
+    alignas(64) float dists[width];
+    dist.store(dists);
+    for (uint32_t i = 0; i < width; ++i) {
+      if ((hitMask & (1 << i)) && dists[i] < minDist) {
+        minDist = dists[i];
+        closestPrimitive = primitives[pack.primitive[i]];
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < width; ++i) {
+    if (pack.scalarMask & (1 << i)) {
+      Primitive* primitive = primitives[pack.primitive[i]];
+      float dist = primitive->intersect(ray);
+      if (dist < minDist) {
+        minDist = dist;
+        closestPrimitive = primitive;
+      }
+    }
+  }
+}
+
+bool WideBVH::intersect(Ray ray, Intersection& intersection) const {
+  intersection.distance = INFINITY;
+  intersection.primitive = nullptr;
+  if (nodes.empty()) return false;
+
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  const vfloat startX(ray.position.x), startY(ray.position.y),
+      startZ(ray.position.z);
+  const vfloat invX(invDirection.x), invY(invDirection.y),
+      invZ(invDirection.z);
+  const vfloat zero(0.f);
+
+  float minDist = INFINITY;
+  Primitive* closestPrimitive = nullptr;
+  TraversalStats stats;
+  StackElement stack[SAHBVH::maxDepth * (width - 1) + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = {0, 0, 0};
+  while (stackSize > 0) {
+    const StackElement element = stack[--stackSize];
+    if (element.distance >= minDist) continue;
+
+    stats.nodes++;
+    if (element.packCount > 0) {
+      // Packed triangles count every SIMD lane, padding included
+      stats.primitives += element.packCount * width;
+      for (uint32_t i = element.offset;
+           i < element.offset + element.packCount; ++i) {
+        intersect(packs[i], ray, minDist, closestPrimitive);
+      }
+      continue;
+    }
+
+    // Slab test against every child box at once, picking the near and far
+    // planes up front from the ray direction signs
+    const Node& node = nodes[element.offset];
+    vfloat tNearX = (vfloat::load(dirIsNeg[0] ? node.bboxMax[0]
+                                              : node.bboxMin[0]) -
+                     startX) *
+                    invX;
+    vfloat tNearY = (vfloat::load(dirIsNeg[1] ? node.bboxMax[1]
+                                              : node.bboxMin[1]) -
+                     startY) *
+                    invY;
+    vfloat tNearZ = (vfloat::load(dirIsNeg[2] ? node.bboxMax[2]
+                                              : node.bboxMin[2]) -
+                     startZ) *
+                    invZ;
+    vfloat tFarX = (vfloat::load(dirIsNeg[0] ? node.bboxMin[0]
+                                             : node.bboxMax[0]) -
+                    startX) *
+                   invX;
+    vfloat tFarY = (vfloat::load(dirIsNeg[1] ? node.bboxMin[1]
+                                             : node.bboxMax[1]) -
+                    startY) *
+                   invY;
+    vfloat tFarZ = (vfloat::load(dirIsNeg[2] ? node.bboxMin[2]
+                                             : node.bboxMax[2]) -
+                    startZ) *
+                   invZ;
+    vfloat tNear = vmax(vmax(tNearX, tNearY), vmax(tNearZ, zero));
+    vfloat tFar = vmin(vmin(tFarX, tFarY), vmin(tFarZ, vfloat(minDist)));
+    int hitMask = movemask(tNear <= tFar);
+    if (hitMask == 0) continue;
+
+    alignas(64) float nearDist[width];
+    tNear.store(nearDist);
+
+    // Order the hit children far to near on the stack so the nearest one is
+    // popped next
+    StackElement hits[width];
+    uint32_t hitCount = 0;
+    for (uint32_t i = 0; i < width; ++i) {
+      if (!(hitMask & (1 << i))) continue;
+      StackElement hit = {node.offset[i], node.packCount[i], nearDist[i]};
+      uint32_t j = hitCount++;
+      while (j > 0 && hits[j - 1].distance < hit.distance) {
+        hits[j] = hits[j - 1];
+        j--;
+      }
+      hits[j] = hit;
+    }
+    for (uint32_t i = 0; i < hitCount; ++i) {
+      stack[stackSize++] = hits[i];
+    }
+  }
+
+  if (closestPrimitive == nullptr) return false;
+  intersection.primitive = closestPrimitive;
+  intersection.distance = minDist;
+  intersection.position = ray.position + minDist * ray.direction;
+  return true;
+}
+
+// Bounds on x * y over x in [x0, x1] and y in [y0, y1], lane by lane
+static inline vfloat productLowerBound(vfloat x0, vfloat x1, vfloat y0,
+                                       vfloat y1) {
+  return vmin(vmin(x0 * y0, x0 * y1), vmin(x1 * y0, x1 * y1));
+}
+static inline vfloat productUpperBound(vfloat x0, vfloat x1, vfloat y0,
+                                       vfloat y1) {
+  return vmax(vmax(x0 * y0, x0 * y1), vmax(x1 * y0, x1 * y1));
+}
+
+void WideBVH::intersect(const RayPacket& packet,
+                        Intersection* intersections) const {
+  // Without shared direction signs the packet has no meaningful frustum
+  if (nodes.empty() || packet.size == 0 || !packet.coherent()) {
+    AccelerationStructure::intersect(packet, intersections);
+    return;
+  }
+
+  const uint32_t groupCount = (packet.size + width - 1) / width;
+  const uint64_t groupMask = (1ull << width) - 1;
+  const uint64_t packetMask =
+      (packet.size == 64) ? ~0ull : (1ull << packet.size) - 1;
+
+  // Interval bounds over the whole packet, used to cull nodes before any
+  // individual ray is looked at
+  vec3 startMin(INFINITY), startMax(-INFINITY);
+  vec3 invMin(INFINITY), invMax(-INFINITY);
+  for (uint32_t i = 0; i < packet.size; ++i) {
+    vec3 start(packet.startX[i], packet.startY[i], packet.startZ[i]);
+    vec3 inv(packet.invX[i], packet.invY[i], packet.invZ[i]);
+    startMin = glm::min(startMin, start);
+    startMax = glm::max(startMax, start);
+    invMin = glm::min(invMin, inv);
+    invMax = glm::max(invMax, inv);
+  }
+  int dirIsNeg[3] = {packet.invX[0] < 0, packet.invY[0] < 0,
+                     packet.invZ[0] < 0};
+
+  alignas(64) float minDist[RayPacket::maxSize];
+  Primitive* closestPrimitive[RayPacket::maxSize];
+  for (uint32_t i = 0; i < RayPacket::maxSize; ++i) {
+    // Lanes past the end of the packet get a distance no box can beat
+    minDist[i] = i < packet.size ? INFINITY : -1.f;
+    closestPrimitive[i] = nullptr;
+  }
+
+  const vfloat zero(0.f);
+  // A node visited by the packet counts once, a leaf once per ray in it
+  TraversalStats stats;
+  PacketStackElement stack[SAHBVH::maxDepth * (width - 1) + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = {0, 0, packetMask};
+  while (stackSize > 0) {
+    const PacketStackElement element = stack[--stackSize];
+
+    stats.nodes++;
+    if (element.packCount > 0) {
+      for (uint32_t r = 0; r < packet.size; ++r) {
+        if (!(element.rayMask & (1ull << r))) continue;
+        stats.primitives += element.packCount * width;
+        for (uint32_t i = element.offset;
+             i < element.offset + element.packCount; ++i) {
+          intersect(packs[i], packet.rays[r], minDist[r], closestPrimitive[r]);
+        }
+      }
+      continue;
+    }
+
+    // Frustum test of every child against the packet bounds
+    const Node& node = nodes[element.offset];
+    float farthest = 0;
+    for (uint32_t r = 0; r < packet.size; ++r) {
+      if ((element.rayMask & (1ull << r)) && minDist[r] > farthest)
+        farthest = minDist[r];
+    }
+    vfloat tNear = zero;
+    vfloat tFar(farthest);
+    const float* starts[2][3] = {{&startMin.x, &startMin.y, &startMin.z},
+                                 {&startMax.x, &startMax.y, &startMax.z}};
+    for (uint8_t axis = 0; axis < 3; ++axis) {
+      vfloat nearPlane = vfloat::load(dirIsNeg[axis] ? node.bboxMax[axis]
+                                                     : node.bboxMin[axis]);
+      vfloat farPlane = vfloat::load(dirIsNeg[axis] ? node.bboxMin[axis]
+                                                    : node.bboxMax[axis]);
+      vfloat lowStart(*starts[0][axis]), highStart(*starts[1][axis]);
+      vfloat lowInv(invMin[axis]), highInv(invMax[axis]);
+      tNear = vmax(tNear, productLowerBound(nearPlane - highStart,
+                                            nearPlane - lowStart, lowInv,
+                                            highInv));
+      tFar = vmin(tFar, productUpperBound(farPlane - highStart,
+                                          farPlane - lowStart, lowInv,
+                                          highInv));
+    }
+    int childMask = movemask(tNear <= tFar);
+    if (childMask == 0) continue;
+
+    alignas(64) float nearDist[width];
+    tNear.store(nearDist);
+
+    // Test the surviving children against the individual rays, a vector of
+    // rays at a time, and keep the ones that have some ray left in them
+    PacketStackElement hits[width];
+    float hitDist[width];
+    uint32_t hitCount = 0;
+    for (uint32_t c = 0; c < width; ++c) {
+      if (!(childMask & (1 << c))) continue;
+      const vfloat nearX(dirIsNeg[0] ? node.bboxMax[0][c] : node.bboxMin[0][c]);
+      const vfloat nearY(dirIsNeg[1] ? node.bboxMax[1][c] : node.bboxMin[1][c]);
+      const vfloat nearZ(dirIsNeg[2] ? node.bboxMax[2][c] : node.bboxMin[2][c]);
+      const vfloat farX(dirIsNeg[0] ? node.bboxMin[0][c] : node.bboxMax[0][c]);
+      const vfloat farY(dirIsNeg[1] ? node.bboxMin[1][c] : node.bboxMax[1][c]);
+      const vfloat farZ(dirIsNeg[2] ? node.bboxMin[2][c] : node.bboxMax[2][c]);
+
+      uint64_t rayMask = 0;
+      for (uint32_t g = 0; g < groupCount; ++g) {
+        uint32_t first = g * width;
+        if (!((element.rayMask >> first) & groupMask)) continue;
+        vfloat startX = vfloat::load(packet.startX + first);
+        vfloat startY = vfloat::load(packet.startY + first);
+        vfloat startZ = vfloat::load(packet.startZ + first);
+        vfloat invX = vfloat::load(packet.invX + first);
+        vfloat invY = vfloat::load(packet.invY + first);
+        vfloat invZ = vfloat::load(packet.invZ + first);
+        vfloat rayNear = vmax(vmax((nearX - startX) * invX,
+                                   (nearY - startY) * invY),
+                              vmax((nearZ - startZ) * invZ, zero));
+        vfloat rayFar =
+            vmin(vmin((farX - startX) * invX, (farY - startY) * invY),
+                 vmin((farZ - startZ) * invZ, vfloat::load(minDist + first)));
+        rayMask |= (uint64_t)movemask(rayNear <= rayFar) << first;
+      }
+      rayMask &= element.rayMask;
+      if (rayMask == 0) continue;
+
+      PacketStackElement hit = {node.offset[c], node.packCount[c], rayMask};
+      uint32_t j = hitCount++;
+      while (j > 0 && hitDist[j - 1] < nearDist[c]) {
+        hits[j] = hits[j - 1];
+        hitDist[j] = hitDist[j - 1];
+        j--;
+      }
+      hits[j] = hit;
+      hitDist[j] = nearDist[c];
+    }
+    for (uint32_t i = 0; i < hitCount; ++i) {
+      stack[stackSize++] = hits[i];
+    }
+  }
+
+  for (uint32_t r = 0; r < packet.size; ++r) {
+    Intersection& intersection = intersections[r];
+    intersection.primitive = closestPrimitive[r];
+    intersection.distance = closestPrimitive[r] ? minDist[r] : INFINITY;
+    if (closestPrimitive[r] != nullptr) {
+      intersection.position =
+          packet.rays[r].position + minDist[r] * packet.rays[r].direction;
+    }
+  }
+}
+
+bool WideBVH::occluded(Ray ray, float maxDistance) const {
+  if (nodes.empty()) return false;
+
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  const vfloat startX(ray.position.x), startY(ray.position.y),
+      startZ(ray.position.z);
+  const vfloat invX(invDirection.x), invY(invDirection.y),
+      invZ(invDirection.z);
+  const vfloat zero(0.f), maxDist(maxDistance);
+
+  // Any hit will do, so hit children are pushed unsorted and the first
+  // primitive found in range ends the query
+  TraversalStats stats;
+  StackElement stack[SAHBVH::maxDepth * (width - 1) + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = {0, 0, 0};
+  while (stackSize > 0) {
+    const StackElement element = stack[--stackSize];
+
+    stats.nodes++;
+    if (element.packCount > 0) {
+      for (uint32_t i = element.offset;
+           i < element.offset + element.packCount; ++i) {
+        stats.primitives += width;
+        float minDist = maxDistance;
+        Primitive* closestPrimitive = nullptr;
+        intersect(packs[i], ray, minDist, closestPrimitive);
+        if (closestPrimitive != nullptr) return true;
+      }
+      continue;
+    }
+
+    const Node& node = nodes[element.offset];
+    vfloat tNearX = (vfloat::load(dirIsNeg[0] ? node.bboxMax[0]
+                                              : node.bboxMin[0]) -
+                     startX) *
+                    invX;
+    vfloat tNearY = (vfloat::load(dirIsNeg[1] ? node.bboxMax[1]
+                                              : node.bboxMin[1]) -
+                     startY) *
+                    invY;
+    vfloat tNearZ = (vfloat::load(dirIsNeg[2] ? node.bboxMax[2]
+                                              : node.bboxMin[2]) -
+                     startZ) *
+                    invZ;
+    vfloat tFarX = (vfloat::load(dirIsNeg[0] ? node.bboxMin[0]
+                                             : node.bboxMax[0]) -
+                    startX) *
+                   invX;
+    vfloat tFarY = (vfloat::load(dirIsNeg[1] ? node.bboxMin[1]
+                                             : node.bboxMax[1]) -
+                    startY) *
+                   invY;
+    vfloat tFarZ = (vfloat::load(dirIsNeg[2] ? node.bboxMin[2]
+                                             : node.bboxMax[2]) -
+                    startZ) *
+                   invZ;
+    vfloat tNear = vmax(vmax(tNearX, tNearY), vmax(tNearZ, zero));
+    vfloat tFar = vmin(vmin(tFarX, tFarY), vmin(tFarZ, maxDist));
+    int hitMask = movemask(tNear <= tFar);
+
+    for (uint32_t i = 0; i < width; ++i) {
+      if (hitMask & (1 << i)) {
+        stack[stackSize++] = {node.offset[i], node.packCount[i], 0};
+      }
+    }
+  }
+  return false;
+}
+
+BBox WideBVH::refit(TrianglePack& pack) {
+  load(pack);
+  BBox bbox;
+  for (uint32_t i = 0; i < width; ++i) {
+    if (i > 0 && pack.primitive[i] == 0) continue;
+    bbox.extendBy(primitiveBounds(primitives[pack.primitive[i]]));
+  }
+  return bbox;
+}
+
+bool WideBVH::refit() {
+  if (nodes.empty()) return true;
+  vector<BBox> packBounds(packs.size());
+#pragma omp parallel for schedule(dynamic, 64)
+  for (uint32_t i = 0; i < packs.size(); ++i) {
+    packBounds[i] = refit(packs[i]);
+  }
+
+  // Interior children are the lanes with no packs. The root is never anyone's
+  // child, so an offset of 0 marks an unused lane.
+  vector<uint32_t> order, levels;
+  levelOrder(
+      [this](uint32_t node, vector<uint32_t>& out) {
+        for (uint32_t i = 0; i < width; ++i) {
+          if (nodes[node].packCount[i] == 0 && nodes[node].offset[i] != 0) {
+            out.push_back(nodes[node].offset[i]);
+          }
+        }
+      },
+      order, levels);
+
+  vector<BBox> nodeBounds(nodes.size());
+  for (int level = levels.size() - 2; level >= 0; --level) {
+#pragma omp parallel for schedule(dynamic, 16)
+    for (uint32_t i = levels[level]; i < levels[level + 1]; ++i) {
+      Node& node = nodes[order[i]];
+      BBox bbox;
+      for (uint32_t lane = 0; lane < width; ++lane) {
+        BBox child;
+        if (node.packCount[lane] > 0) {
+          for (uint32_t p = node.offset[lane];
+               p < node.offset[lane] + node.packCount[lane]; ++p) {
+            child.extendBy(packBounds[p]);
+          }
+        } else if (node.offset[lane] != 0) {
+          child = nodeBounds[node.offset[lane]];
+        } else {
+          continue;
+        }
+        for (uint8_t axis = 0; axis < 3; ++axis) {
+          node.bboxMin[axis][lane] = child[0][axis];
+          node.bboxMax[axis][lane] = child[1][axis];
+        }
+        bbox.extendBy(child);
+      }
+      nodeBounds[order[i]] = bbox;
+    }
+  }
+  return true;
+}
+
+float WideBVH::sahCost() const {
+  if (nodes.empty()) return 0;
+  float cost = 0;
+  BBox root;
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    for (uint32_t lane = 0; lane < width; ++lane) {
+      if (nodes[i].packCount[lane] == 0 && nodes[i].offset[lane] == 0) {
+        continue;
+      }
+      BBox child(vec3(nodes[i].bboxMin[0][lane], nodes[i].bboxMin[1][lane],
+                      nodes[i].bboxMin[2][lane]),
+                 vec3(nodes[i].bboxMax[0][lane], nodes[i].bboxMax[1][lane],
+                      nodes[i].bboxMax[2][lane]));
+      if (i == 0) root.extendBy(child);
+      // Leaves test every lane of their packs
+      cost += child.surfaceArea() * (nodes[i].packCount[lane] > 0
+                                         ? nodes[i].packCount[lane] * width
+                                         : sahTraversalCost);
+    }
+  }
+  float rootArea = root.surfaceArea();
+  return rootArea > 0 ? cost / rootArea : 0;
+}
+
+/* INSTANCE IMPLEMENTATION */
+
+Instance::Instance(Object* mesh, const mat4& transform)
+    : mesh(mesh), objectToWorld(transform) {
+  updateBounds();
+}
+
+void Instance::updateBounds() {
+  const vec3 axes[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+  meshBounds = BBox();
+  for (uint8_t j = 0; j < 3; ++j) {
+    mesh->computeBounds(axes[j], meshBounds[0][j], meshBounds[1][j]);
+  }
+  setTransform(objectToWorld);
+}
+
+void Instance::setTransform(const mat4& transform) {
+  objectToWorld = transform;
+  worldToObject = glm::inverse(transform);
+  bbox = BBox();
+  if (mesh->primitives.empty()) return;
+  for (uint8_t corner = 0; corner < 8; ++corner) {
+    vec4 point(meshBounds[corner & 1].x, meshBounds[(corner >> 1) & 1].y,
+               meshBounds[(corner >> 2) & 1].z, 1);
+    bbox.extendBy(vec3(objectToWorld * point));
+  }
+}
+
+Ray Instance::toObject(const Ray& ray, float& scale) const {
+  vec4 direction = worldToObject * vec4(vec3(ray.direction), 0);
+  scale = glm::length(vec3(direction));
+  Ray local;
+  local.position = worldToObject * vec4(vec3(ray.position), 1);
+  local.direction = direction / scale;
+  return local;
+}
+
+bool Instance::intersect(const Ray& ray, Intersection& intersection) const {
+  float scale;
+  Ray local = toObject(ray, scale);
+  Intersection hit;
+  bool found = blas != nullptr ? blas->intersect(local, hit)
+                               : mesh->intersect(local, hit);
+  if (!found) return false;
+
+  intersection = hit;
+  intersection.distance = hit.distance / scale;
+  intersection.position = ray.position + intersection.distance * ray.direction;
+  // Normals go back through the inverse transpose so they stay perpendicular
+  // under non uniform scaling
+  vec4 normal = hit.primitive->getNormal(hit.position);
+  intersection.normal = vec4(glm::normalize(vec3(
+                                 glm::transpose(worldToObject) *
+                                 vec4(vec3(normal), 0))),
+                             0);
+  return true;
+}
+
+bool Instance::occluded(const Ray& ray, float maxDistance) const {
+  float scale;
+  Ray local = toObject(ray, scale);
+  if (blas != nullptr) return blas->occluded(local, maxDistance * scale);
+  for (uint32_t i = 0; i < mesh->primitives.size(); ++i) {
+    if (mesh->primitives[i]->intersect(local) < maxDistance * scale) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* TOP LEVEL BVH IMPLEMENTATION */
+
+TopLevelBVH::TopLevelBVH(const AccelerationStructure* world,
+                         const vector<Instance*>& instances)
+    : world(world), instances(instances.begin(), instances.end()) {
+  if (instances.empty()) return;
+  nodes.reserve(2 * instances.size());
+  nodes.resize(1);
+  build(0, 0, instances.size(), 0);
+}
+
+// Instances are few and every one is a whole mesh, so a median split on the
+// widest spread of centres is all the top level needs
+void TopLevelBVH::build(uint32_t node, uint32_t start, uint32_t end,
+                        uint32_t depth) {
+  BBox bbox, centroidBounds;
+  for (uint32_t i = start; i < end; ++i) {
+    bbox.extendBy(instances[i]->bbox);
+    centroidBounds.extendBy(instances[i]->bbox.centroid());
+  }
+  nodes[node].bbox = bbox;
+  if (end - start == 1 || depth + 1 >= maxDepth) {
+    nodes[node].offset = start;
+    nodes[node].count = end - start;
+    return;
+  }
+
+  uint8_t axis = centroidBounds.maxExtent();
+  uint32_t mid = (start + end) / 2;
+  nth_element(instances.begin() + start, instances.begin() + mid,
+              instances.begin() + end,
+              [axis](const Instance* a, const Instance* b) {
+                return a->bbox.centroid()[axis] < b->bbox.centroid()[axis];
+              });
+  uint32_t child = nodes.size();
+  nodes.resize(child + 2);
+  nodes[node].offset = child;
+  nodes[node].count = 0;
+  build(child, start, mid, depth + 1);
+  build(child + 1, mid, end, depth + 1);
+}
+
+bool TopLevelBVH::intersect(Ray ray, Intersection& intersection) const {
+  intersection.distance = INFINITY;
+  intersection.primitive = nullptr;
+  if (world != nullptr && world->intersect(ray, intersection)) {
+    intersection.normal =
+        intersection.primitive->getNormal(intersection.position);
+  }
+  if (nodes.empty()) return intersection.primitive != nullptr;
+
+  vec3 start = vec3(ray.position);
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  TraversalStats stats;
+  uint32_t stack[maxDepth + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const Node& node = nodes[stack[--stackSize]];
+    float tNear = 0, tFar = intersection.distance;
+    stats.nodes++;
+    if (!node.bbox.intersect(start, invDirection, dirIsNeg, tNear, tFar)) {
+      continue;
+    }
+    if (node.count == 0) {
+      stack[stackSize++] = node.offset + 1;
+      stack[stackSize++] = node.offset;
+      continue;
+    }
+    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+      Intersection hit;
+      if (instances[i]->intersect(ray, hit) &&
+          hit.distance < intersection.distance) {
+        intersection = hit;
+      }
+    }
+  }
+  return intersection.primitive != nullptr;
+}
+
+bool TopLevelBVH::occluded(Ray ray, float maxDistance) const {
+  if (world != nullptr && world->occluded(ray, maxDistance)) return true;
+  if (nodes.empty()) return false;
+
+  vec3 start = vec3(ray.position);
+  vec3 invDirection = 1.f / vec3(ray.direction);
+  int dirIsNeg[3] = {invDirection.x < 0, invDirection.y < 0,
+                     invDirection.z < 0};
+  TraversalStats stats;
+  uint32_t stack[maxDepth + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const Node& node = nodes[stack[--stackSize]];
+    float tNear = 0, tFar = maxDistance;
+    stats.nodes++;
+    if (!node.bbox.intersect(start, invDirection, dirIsNeg, tNear, tFar)) {
+      continue;
+    }
+    if (node.count == 0) {
+      stack[stackSize++] = node.offset + 1;
+      stack[stackSize++] = node.offset;
+      continue;
+    }
+    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+      if (instances[i]->occluded(ray, maxDistance)) return true;
+    }
+  }
+  return false;
+}
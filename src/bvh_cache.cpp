@@ -0,0 +1,197 @@
+#include "bvh_cache.h"
+
+#include <string.h>
+#include <cstdio>
+#include <fstream>
+#include <unordered_map>
+
+using namespace std;
+using glm::vec3;
+
+// Bump whenever the layout of the file changes
+static const uint32_t cacheVersion = 2;
+static const char cacheMagic[8] = {'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E'};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t type;
+  uint64_t hash;
+  uint32_t primitiveCount;
+  uint32_t nodeCount;
+  uint32_t packCount;
+  float builtCost;
+  // Where each array starts in the file. Nodes are cache line aligned in
+  // memory, so these are multiples of 64 from the page aligned mapping.
+  uint64_t indexOffset;
+  uint64_t nodeOffset;
+  uint64_t packOffset;
+};
+
+// FNV-1a a word at a time
+static void mix(uint64_t& hash, uint32_t word) {
+  hash = (hash ^ word) * 0x100000001b3ull;
+}
+
+static void mix(uint64_t& hash, float value) {
+  uint32_t word;
+  memcpy(&word, &value, sizeof(word));
+  mix(hash, word);
+}
+
+/* Hash of everything a tree of this type depends on: the size of its nodes,
+ * which changes with SIMD_WIDTH, and the primitives in the order the builder
+ * sees them. Triangles are hashed by their vertices, which the wide BVH copies
+ * into its packs, anything else by its bounds. */
+static uint64_t geometryHash(BVHType type, const vector<Object*>& objects) {
+  const vec3 axes[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+  uint64_t hash = 0xcbf29ce484222325ull;
+  mix(hash, (uint32_t)type);
+  mix(hash, (uint32_t)sizeof(SAHBVH::LinearNode));
+  mix(hash, (uint32_t)sizeof(WideBVH::Node));
+  mix(hash, (uint32_t)sizeof(WideBVH::TrianglePack));
+  for (const Object* object : objects) {
+    mix(hash, (uint32_t)object->primitives.size());
+    for (Primitive* primitive : object->primitives) {
+      Triangle* tri = dynamic_cast<Triangle*>(primitive);
+      if (tri != nullptr) {
+        mix(hash, 1u);
+        for (const Vertex* vertex : {&tri->v0, &tri->v1, &tri->v2}) {
+          for (uint8_t axis = 0; axis < 3; ++axis) {
+            mix(hash, vertex->position[axis]);
+          }
+        }
+      } else {
+        mix(hash, 2u);
+        for (uint8_t axis = 0; axis < 3; ++axis) {
+          float dnear = INFINITY, dfar = -INFINITY;
+          primitive->computeBounds(axes[axis], dnear, dfar);
+          mix(hash, dnear);
+          mix(hash, dfar);
+        }
+      }
+    }
+  }
+  return hash;
+}
+
+AccelerationStructure* LoadBVHCache(const string& path, BVHType type,
+                                    const vector<Object*>& objects) {
+  if (type != BVH_SAH && type != BVH_WIDE) return NULL;
+  shared_ptr<MappedFile> file = make_shared<MappedFile>(path);
+  if (file->data == nullptr || file->size < sizeof(CacheHeader)) return NULL;
+  CacheHeader header;
+  memcpy(&header, file->data, sizeof(header));
+  if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 ||
+      header.version != cacheVersion || header.type != (uint32_t)type ||
+      header.hash != geometryHash(type, objects)) {
+    return NULL;
+  }
+
+  uint64_t nodeSize = type == BVH_SAH ? sizeof(SAHBVH::LinearNode)
+                                      : sizeof(WideBVH::Node);
+  if (header.indexOffset + header.primitiveCount * 4ull > file->size ||
+      header.nodeOffset + header.nodeCount * nodeSize > file->size ||
+      header.packOffset + header.packCount * sizeof(WideBVH::TrianglePack) >
+          file->size) {
+    return NULL;
+  }
+
+  // The hash covers the primitives' order, so indices into them still hold
+  vector<Primitive*> scenePrimitives;
+  for (const Object* object : objects) {
+    scenePrimitives.insert(scenePrimitives.end(), object->primitives.begin(),
+                           object->primitives.end());
+  }
+  const uint32_t* indices =
+      reinterpret_cast<const uint32_t*>(file->data + header.indexOffset);
+  vector<Primitive*> primitives(header.primitiveCount);
+  for (uint32_t i = 0; i < header.primitiveCount; ++i) {
+    if (indices[i] >= scenePrimitives.size()) return NULL;
+    primitives[i] = scenePrimitives[indices[i]];
+  }
+
+  if (type == BVH_SAH) {
+    SAHBVH* bvh = new SAHBVH();
+    bvh->primitives.swap(primitives);
+    bvh->nodes.map(file, header.nodeOffset, header.nodeCount);
+    bvh->builtCost = header.builtCost;
+    return bvh;
+  }
+  WideBVH* bvh = new WideBVH();
+  bvh->primitives.swap(primitives);
+  bvh->nodes.map(file, header.nodeOffset, header.nodeCount);
+  bvh->packs.map(file, header.packOffset, header.packCount);
+  bvh->builtCost = header.builtCost;
+  return bvh;
+}
+
+bool SaveBVHCache(const string& path, const AccelerationStructure* structure,
+                  const vector<Object*>& objects) {
+  CacheHeader header;
+  memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.builtCost = structure->builtCost;
+  header.packCount = 0;
+  const vector<Primitive*>* primitives;
+  const void* nodes;
+  const void* packs = nullptr;
+  uint64_t nodeSize;
+  const SAHBVH* sah = dynamic_cast<const SAHBVH*>(structure);
+  const WideBVH* wide = dynamic_cast<const WideBVH*>(structure);
+  if (sah != nullptr) {
+    header.type = BVH_SAH;
+    primitives = &sah->primitives;
+    nodes = sah->nodes.data();
+    header.nodeCount = sah->nodes.size();
+    nodeSize = sizeof(SAHBVH::LinearNode);
+  } else if (wide != nullptr) {
+    header.type = BVH_WIDE;
+    primitives = &wide->primitives;
+    nodes = wide->nodes.data();
+    header.nodeCount = wide->nodes.size();
+    nodeSize = sizeof(WideBVH::Node);
+    packs = wide->packs.data();
+    header.packCount = wide->packs.size();
+  } else {
+    return false;
+  }
+  header.hash = geometryHash((BVHType)header.type, objects);
+
+  // Primitives are stored by where they are in objects
+  unordered_map<const Primitive*, uint32_t> sceneIndex;
+  uint32_t count = 0;
+  for (const Object* object : objects) {
+    for (const Primitive* primitive : object->primitives) {
+      sceneIndex.emplace(primitive, count++);
+    }
+  }
+  vector<uint32_t> indices(primitives->size());
+  for (uint32_t i = 0; i < indices.size(); ++i) {
+    auto index = sceneIndex.find((*primitives)[i]);
+    if (index == sceneIndex.end()) return false;
+    indices[i] = index->second;
+  }
+  header.primitiveCount = indices.size();
+  header.indexOffset = alignOffset(sizeof(header), 64);
+  header.nodeOffset = alignOffset(header.indexOffset + indices.size() * 4, 64);
+  header.packOffset =
+      alignOffset(header.nodeOffset + header.nodeCount * nodeSize, 64);
+
+  // Written under another name and moved over the old cache once complete,
+  // so that no run ever maps half a file
+  string temporary = path + ".tmp";
+  ofstream file(temporary.c_str(), ios::binary | ios::trunc);
+  if (!file) return false;
+  writeAt(file, 0, &header, sizeof(header));
+  writeAt(file, header.indexOffset, indices.data(), indices.size() * 4);
+  writeAt(file, header.nodeOffset, nodes, header.nodeCount * nodeSize);
+  writeAt(file, header.packOffset, packs,
+          header.packCount * sizeof(WideBVH::TrianglePack));
+  file.close();
+  if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
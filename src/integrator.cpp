@@ -0,0 +1,321 @@
+#include "integrator.h"
+#include "stats.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+using glm::dot;
+using glm::mat3;
+using glm::vec2;
+using glm::vec3;
+using glm::vec4;
+
+Scene *scene;
+RenderSettings settings;
+
+vec3 Light(const vec4 start, const vec4 dir, Sampler &sampler, float currIor,
+           int bounce) {
+  Intersection intersection;
+  Ray ray;
+
+  ray.position = start + dir * 1e-4f;
+  ray.direction = dir;
+  if (scene->intersect(ray, intersection)) {
+    return Shade(intersection, dir, sampler, currIor, bounce);
+  }
+  return vec3(0);
+}
+
+/* Follows the path from its first hit until it escapes or is terminated,
+ * carrying the product of the surface weights seen so far as its throughput.
+ * Without STOCHASTIC_FRESNEL glass splits the path in two: the reflected half
+ * is followed straight away and the refracted half waits on a stack. */
+vec3 Shade(const Intersection &intersection, const vec4 dir, Sampler &sampler,
+           float currIor, int bounce) {
+  // A split pushes one segment one bounce deeper than anything below it, and
+  // nothing splits beyond maxBounces, so the stack can not overflow
+  PathSegment stack[MAX_BOUNCES_LIMIT + 2];
+  int stackSize = 0;
+
+  PathSegment path;
+  path.ray.position = intersection.position;
+  path.ray.direction = dir;
+  path.throughput = vec3(1);
+  path.ior = currIor;
+  path.bounce = bounce;
+  path.bsdfPdf = 0;
+
+  Intersection hit = intersection;
+  vec3 radiance = vec3(0);
+  Ray ray;
+  STAT_ADD(STAT_PATHS, 1);
+  while (true) {
+    STAT_ADD(STAT_PATH_VERTICES, 1);
+    const Material &material = scene->material(hit.primitive);
+    const vec4 dir = path.ray.direction;
+    bool extended = false;
+
+    // Russian roulette termination, more likely the less the rest of the path
+    // could contribute. Survivors are weighted up to keep the estimate fair.
+    float survival = 1;
+    if (path.bounce > settings.minBounces) {
+      survival = path.bounce > settings.maxBounces
+                     ? 0.f
+                     : min(max3(path.throughput * material.color), 1.f);
+    }
+
+    if (material.isLight()) {
+      radiance += path.throughput * material.emission *
+                  EmissionWeight(hit, dir, path.bsdfPdf);
+    } else if (sampler.get1D() >= survival) {
+      STAT_ADD(STAT_ROULETTE_TERMINATIONS, survival > 0);
+    } else {
+      path.throughput /= survival;
+      path.bounce++;
+      vec4 hitPos = hit.position;
+      vec4 normal = hit.normal;
+      if (material.transmittance.x > 0 || material.transmittance.y > 0 ||
+          material.transmittance.z > 0) {
+        // Glass is a perfect mirror and refractor, which no light sample can
+        // hit, so anything it leads to is found by the path alone
+        path.throughput *= material.color;
+        path.bsdfPdf = 0;
+        float kr;
+        fresnel(dir, normal, material.refractiveIndex, kr);
+        bool isInside = glm::dot(dir, normal) > 0;
+        vec4 bias = 1e-4f * normal;
+        float eta = !isInside ? 1.f / material.refractiveIndex
+                              : material.refractiveIndex;
+        path.ior = isInside ? 1.f : material.refractiveIndex;
+        normal = isInside ? -normal : normal;
+        vec4 start = isInside ? hitPos + bias : hitPos - bias;
+        path.ray.position = start;
+#ifdef STOCHASTIC_FRESNEL
+        // Follow only one half, picked with the probability it is weighted by
+        // so the weights cancel and the path stays a single ray
+        if (kr < 1 && sampler.get1D() >= kr) {
+          path.ray.direction = glm::normalize(glm::refract(dir, normal, eta));
+          STAT_ADD(STAT_REFRACTION_RAYS, 1);
+        } else {
+          path.ray.direction = glm::normalize(glm::reflect(dir, normal));
+          STAT_ADD(STAT_SPECULAR_RAYS, 1);
+        }
+#else
+        if (kr < 1) {
+          PathSegment &refracted = stack[stackSize++];
+          refracted = path;
+          refracted.throughput *= 1 - kr;
+          refracted.ray.direction =
+              glm::normalize(glm::refract(dir, normal, eta));
+          STAT_ADD(STAT_REFRACTION_RAYS, 1);
+        }
+        path.throughput *= kr;
+        path.ray.direction = glm::normalize(glm::reflect(dir, normal));
+        STAT_ADD(STAT_SPECULAR_RAYS, 1);
+#endif
+        extended = true;
+      } else {
+        vec3 wo = glm::normalize(vec3(dir));
+        vec3 n = vec3(normal);
+        if (dot(wo, n) > 0) n = -n;
+
+        // Direct Light, from a few emitters picked by their power rather than
+        // every one in the scene
+        for (int i = 0; i < LIGHT_SAMPLES && !scene->emitters.empty(); i++) {
+          vec3 contribution;
+          float maxDistance;
+          if (SampleDirectLight(material, hitPos, wo, n, sampler, ray,
+                                maxDistance, contribution)) {
+            STAT_ADD(STAT_SHADOW_RAYS, 1);
+            if (!scene->occluded(ray, maxDistance)) {
+              radiance += path.throughput * contribution;
+            }
+          }
+        }
+
+        // Indirect Light
+        BSDFSample sample;
+        if (SampleBSDF(material, wo, n, sampler, sample)) {
+          path.throughput *= sample.weight;
+          path.bsdfPdf = sample.pdf;
+          path.ray.position = hitPos;
+          path.ray.direction = vec4(sample.direction, 0);
+          path.ior = material.refractiveIndex;
+          STAT_ADD(sample.specular ? STAT_SPECULAR_RAYS : STAT_DIFFUSE_RAYS, 1);
+          extended = true;
+        }
+      }
+    }
+
+    // Find the next hit, falling back on the waiting glass segments once this
+    // path has ended
+    while (true) {
+      if (extended) {
+        ray.position = path.ray.position + path.ray.direction * 1e-4f;
+        ray.direction = path.ray.direction;
+        if (scene->intersect(ray, hit)) break;
+      }
+      if (stackSize == 0) return radiance;
+      path = stack[--stackSize];
+      extended = true;
+    }
+  }
+}
+
+// Diffuse and specular reflectance, scaled down together if they would
+// reflect more light than arrives
+static void lobeWeights(const Material &material, vec3 &kd, vec3 &ks) {
+  float scale = 1.f / max(max3(material.diffuse + material.specular), 1.f);
+  kd = material.diffuse * scale;
+  ks = material.specular * scale;
+}
+
+// Chance of sampling the diffuse lobe rather than the specular one
+static float diffuseProbability(const vec3 &kd, const vec3 &ks) {
+  float d = dot(kd, vec3(1.f / 3.f));
+  float s = dot(ks, vec3(1.f / 3.f));
+  return d + s > 0 ? d / (d + s) : 1.f;
+}
+
+static float powerHeuristic(float pdf, float otherPdf) {
+  return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+vec3 EvalBSDF(const Material &material, const vec3 &wo, const vec3 &n,
+              const vec3 &wi) {
+  if (dot(wi, n) <= 0) return vec3(0);
+  vec3 kd, ks;
+  lobeWeights(material, kd, ks);
+  float s = material.shininess;
+  float cosAlpha = max(dot(glm::reflect(wo, n), wi), 0.f);
+  return material.color *
+         (kd * (float)M_1_PI +
+          ks * (float)((s + 2) / (2 * M_PI)) * powf(cosAlpha, s));
+}
+
+float BSDFPdf(const Material &material, const vec3 &wo, const vec3 &n,
+              const vec3 &wi) {
+  float cosTheta = dot(wi, n);
+  if (cosTheta <= 0) return 0;
+  vec3 kd, ks;
+  lobeWeights(material, kd, ks);
+  float pd = diffuseProbability(kd, ks);
+  float s = material.shininess;
+  float cosAlpha = max(dot(glm::reflect(wo, n), wi), 0.f);
+  return pd * cosTheta * (float)M_1_PI +
+         (1 - pd) * (float)((s + 1) / (2 * M_PI)) * powf(cosAlpha, s);
+}
+
+bool SampleBSDF(const Material &material, const vec3 &wo, const vec3 &n,
+                Sampler &sampler, BSDFSample &sample) {
+  vec3 kd, ks;
+  lobeWeights(material, kd, ks);
+  sample.specular = sampler.get1D() >= diffuseProbability(kd, ks);
+
+  // Both lobes are sampled about an axis, the normal or the mirror direction
+  vec3 axis = sample.specular ? glm::reflect(wo, n) : n;
+  vec3 local = sample.specular
+                   ? samplePhongLobe(material.shininess, sampler.get2D())
+                   : cosineSampleHemisphere(sampler.get2D());
+  vec3 Nt, Nb;
+  createCoordinateSystem(axis, Nt, Nb);
+  sample.direction = mat3(Nb, axis, Nt) * local;
+
+  sample.pdf = BSDFPdf(material, wo, n, sample.direction);
+  if (sample.pdf <= 0) return false;
+  sample.weight = EvalBSDF(material, wo, n, sample.direction) *
+                  dot(sample.direction, n) / sample.pdf;
+  return true;
+}
+
+bool SampleDirectLight(const Material &material, const vec4 &position,
+                       const vec3 &wo, const vec3 &n, Sampler &sampler,
+                       Ray &shadow, float &maxDistance, vec3 &contribution) {
+  float pmf;
+  Primitive *light = scene->sampleEmitter(sampler.get1D(), pmf);
+  vec2 u = sampler.get2D();
+  if (light == NULL) return false;
+  vec4 lightPos = light->randomPoint(u);
+  vec3 lightVec = vec3(lightPos - position);
+  float distance2 = dot(lightVec, lightVec);
+  float distance = sqrtf(distance2);
+  vec3 wi = lightVec / distance;
+  float cosLight = -dot(vec3(light->getNormal(lightPos)), wi);
+  vec3 f = EvalBSDF(material, wo, n, wi);
+  if (cosLight <= 0 || f == vec3(0)) return false;
+
+  // The point was picked by area, its pdf over directions seen from here
+  float lightPdf = pmf * distance2 / (light->area() * cosLight);
+  float weight = powerHeuristic(LIGHT_SAMPLES * lightPdf,
+                                BSDFPdf(material, wo, n, wi));
+  contribution = scene->material(light).emission * f * dot(wi, n) * weight /
+                 (lightPdf * LIGHT_SAMPLES);
+
+  // Only blockers strictly between the two points matter, so stop short of
+  // the sampled point on the light itself
+  shadow.position = position + vec4(wi, 0) * 1e-4f;
+  shadow.direction = vec4(wi, 0);
+  maxDistance = distance - 2e-4f;
+  return true;
+}
+
+float EmissionWeight(const Intersection &hit, const vec4 &dir, float bsdfPdf) {
+  vec3 wi = glm::normalize(vec3(dir));
+  float cosLight = -dot(vec3(hit.normal), wi);
+  if (cosLight <= 0) return 0;
+  float pmf = scene->emitterPmf(hit.primitive);
+  if (bsdfPdf == 0 || pmf == 0) return 1;
+  float lightPdf = pmf * hit.distance * hit.distance /
+                   (hit.primitive->area() * cosLight);
+  return powerHeuristic(bsdfPdf, LIGHT_SAMPLES * lightPdf);
+}
+
+// Directions about the y axis with density cos(theta) / pi
+vec3 cosineSampleHemisphere(const vec2 &u) {
+  float r = sqrtf(u.x);
+  float phi = 2 * M_PI * u.y;
+  return vec3(r * cosf(phi), sqrtf(max(0.f, 1 - u.x)), r * sinf(phi));
+}
+
+// Directions about the y axis with density (n + 1) / (2 pi) * cos(alpha)^n
+vec3 samplePhongLobe(float exponent, const vec2 &u) {
+  float cosAlpha = powf(u.x, 1.f / (exponent + 1));
+  float sinAlpha = sqrtf(max(0.f, 1 - cosAlpha * cosAlpha));
+  float phi = 2 * M_PI * u.y;
+  return vec3(sinAlpha * cosf(phi), cosAlpha, sinAlpha * sinf(phi));
+}
+
+void createCoordinateSystem(const vec3 &N, vec3 &Nt, vec3 &Nb) {
+  if (fabs(N.x) > fabs(N.y))
+    Nt = glm::normalize(vec3(N.z, 0, -N.x));
+  else
+    Nt = glm::normalize(vec3(0, -N.z, N.y));
+  Nb = glm::cross(N, Nt);
+}
+
+void fresnel(vec4 I, vec4 N, float ior, float &kr) {
+  float cosi = glm::clamp(glm::dot(I, N), -1.f, 1.f);
+  float etai = 1, etat = ior;
+  if (cosi > 0) {
+    swap(etai, etat);
+  }
+  // Compute sini using Snell's law
+  float sint = etai / etat * sqrtf(max(0.f, 1 - powf(cosi, 2.f)));
+  // Total internal reflection
+  if (sint >= 1) {
+    kr = 1;
+  } else {
+    float cost = sqrtf(max(0.f, 1 - powf(sint, 2.f)));
+    cosi = fabsf(cosi);
+    float Rs =
+        ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+    float Rp =
+        ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+    kr = (Rs * Rs + Rp * Rp) / 2;
+  }
+  // As a consequence of the conservation of energy, transmittance is given by:
+  // kt = 1 - kr;
+}
+
+float max3(vec3 v) { return max(v.x, max(v.y, v.z)); }
@@ -0,0 +1,44 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <ostream>
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      data = static_cast<char*>(mapping);
+      size = info.st_size;
+    }
+  }
+  // The mapping keeps its own reference to the file
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data != nullptr) munmap(data, size);
+}
+
+uint64_t alignOffset(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+void writeAt(std::ostream& file, uint64_t offset, const void* data,
+             uint64_t bytes) {
+  static const char zeros[64] = {};
+  uint64_t position = file.tellp();
+  while (position < offset) {
+    uint64_t padding = std::min<uint64_t>(offset - position, sizeof(zeros));
+    file.write(zeros, padding);
+    position += padding;
+  }
+  file.write(static_cast<const char*>(data), bytes);
+}
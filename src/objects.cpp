@@ -1,5 +1,6 @@
 #include "objects.h"
 #include <iostream>
+#include "stats.h"
 
 using namespace std;
 
@@ -40,6 +41,11 @@ vec3 Texture::sample(vec2 uv) {
   return vec3(r, g, b);
 }
 
+/* MATERIAL IMPLEMENTATION */
+bool Material::isLight() const {
+  return emission.x > 0 || emission.y > 0 || emission.z > 0;
+}
+
 /* VERTEX IMPLEMENTATION */
 Vertex::Vertex(){};
 Vertex::Vertex(vec4 position)
@@ -50,20 +56,20 @@ Vertex::Vertex(vec4 position, vec4 normal, vec2 uv, vec3 color)
     : position(position), normal(normal), uv(uv), color(color){};
 
 /* SHAPE CLASS IMPLEMENTATION */
-Primitive::Primitive(Material material) : material(material) {}
-vec4 Primitive::randomPoint() { return vec4(); };
+Primitive::Primitive(uint32_t materialId) : materialId(materialId) {}
+vec4 Primitive::randomPoint(const vec2 &u) { return vec4(); };
 vec4 Primitive::getNormal(const vec4 &p) { return vec4(); };
-bool Primitive::isLight() {
-  return material.emission.x > 0 || material.emission.y > 0 ||
-         material.emission.z > 0;
-}
 float Primitive::intersect(Ray ray) { return INFINITY; }
+float Primitive::area() { return 0; }
+void Primitive::computeBounds(const vec3 &planeNormal, float &dnear,
+                              float &dfar) {}
 
 /* OBJECT CLASS IMPLEMENTATION */
 Object::Object(vector<Primitive *> primitives) : primitives(primitives){};
 bool Object::intersect(Ray ray, Intersection &intersection) const {
   Primitive *closestPrimitive = NULL;
   float minDist = INFINITY;
+  STAT_ADD(STAT_PRIMITIVES_TESTED, primitives.size());
   for (uint32_t i = 0; i < primitives.size(); ++i) {
     float dist = primitives[i]->intersect(ray);
     if (dist < minDist) {
@@ -77,48 +83,16 @@ bool Object::intersect(Ray ray, Intersection &intersection) const {
   return closestPrimitive != NULL && minDist != INFINITY;
 }
 void Object::computeBounds(const vec3 &planeNormal, float &dnear, float &dfar) {
-  float d;
   for (uint32_t i = 0; i < primitives.size(); i++) {
-    Triangle *tri;
-    Sphere *sph;
-    if ((tri = dynamic_cast<Triangle *>(primitives[i]))) {
-      d = dot(planeNormal,
-              vec3(tri->v0.position.x, tri->v0.position.y, tri->v0.position.z));
-      if (d < dnear) dnear = d;
-      if (d > dfar) dfar = d;
-
-      d = dot(planeNormal,
-              vec3(tri->v1.position.x, tri->v1.position.y, tri->v1.position.z));
-      if (d < dnear) dnear = d;
-      if (d > dfar) dfar = d;
-
-      d = dot(planeNormal,
-              vec3(tri->v2.position.x, tri->v2.position.y, tri->v2.position.z));
-      if (d < dnear) dnear = d;
-      if (d > dfar) dfar = d;
-    }
-    if ((sph = dynamic_cast<Sphere *>(primitives[i]))) {
-      d = dot(planeNormal,
-              vec3(sph->c.x, sph->c.y, sph->c.z) + (planeNormal * sph->radius));
-      if (d < dnear) dnear = d;
-      if (d > dfar) dfar = d;
-
-      d = dot(planeNormal,
-              vec3(sph->c.x, sph->c.y, sph->c.z) - (planeNormal * sph->radius));
-      if (d < dnear) dnear = d;
-      if (d > dfar) dfar = d;
-    }
+    primitives[i]->computeBounds(planeNormal, dnear, dfar);
   }
 }
 
 /* TRIANGLE CLASS IMPLEMENTATION */
 Triangle::Triangle(Vertex vertex0, Vertex vertex1, Vertex vertex2,
-                   Material material)
-    : Primitive(material), v0(vertex0), v1(vertex1), v2(vertex2) {
+                   uint32_t materialId)
+    : Primitive(materialId), v0(vertex0), v1(vertex1), v2(vertex2) {
   Triangle::ComputeNormal();
-  v0.color = material.color;
-  v1.color = material.color;
-  v2.color = material.color;
   if (v0.normal == vec4(0) || v1.normal == vec4(0) || v2.normal == vec4(0)) {
     v0.normal = normal;
     v1.normal = normal;
@@ -126,14 +100,11 @@ Triangle::Triangle(Vertex vertex0, Vertex vertex1, Vertex vertex2,
   }
 }
 vec4 Triangle::getNormal(const vec4 &p) { return normal; }
-vec4 Triangle::randomPoint() {
-  while (1) {
-    float u = rand() / (float)RAND_MAX;
-    float v = rand() / (float)RAND_MAX;
-    if (u >= 0 && v >= 0 && u + v <= 1) {
-      return v0.position + vec4(u * e1 + v * e2, 1);
-    }
-  }
+vec4 Triangle::randomPoint(const vec2 &u) {
+  // Fold the far half of the square back onto the triangle rather than
+  // rejecting it, so every sample is used
+  vec2 p = u.x + u.y > 1 ? vec2(1) - u : u;
+  return v0.position + vec4(p.x * e1 + p.y * e2, 0);
 }
 float Triangle::intersect(Ray ray) {
   vec3 b = glm::vec3(ray.position - v0.position);
@@ -151,6 +122,22 @@ float Triangle::intersect(Ray ray) {
   }
   return INFINITY;
 }
+float Triangle::area() { return 0.5f * glm::length(glm::cross(e1, e2)); }
+void Triangle::computeBounds(const vec3 &planeNormal, float &dnear,
+                             float &dfar) {
+  float d;
+  d = dot(planeNormal, vec3(v0.position));
+  if (d < dnear) dnear = d;
+  if (d > dfar) dfar = d;
+
+  d = dot(planeNormal, vec3(v1.position));
+  if (d < dnear) dnear = d;
+  if (d > dfar) dfar = d;
+
+  d = dot(planeNormal, vec3(v2.position));
+  if (d < dnear) dnear = d;
+  if (d > dfar) dfar = d;
+}
 void Triangle::ComputeNormal() {
   e1 = glm::vec3(v1.position - v0.position);
   e2 = glm::vec3(v2.position - v0.position);
@@ -159,8 +146,8 @@ void Triangle::ComputeNormal() {
 }
 
 /* SPHERE CLASS IMPLEMENTATION */
-Sphere::Sphere(vec4 c, float radius, Material material)
-    : Primitive(material), c(c), radius(radius) {}
+Sphere::Sphere(vec4 c, float radius, uint32_t materialId)
+    : Primitive(materialId), c(c), radius(radius) {}
 vec4 Sphere::getNormal(const vec4 &p) { return (p - c) / radius; }
 float Sphere::intersect(Ray ray) {
   vec4 sC = ray.position - c;
@@ -181,3 +168,14 @@ float Sphere::intersect(Ray ray) {
   }
   return INFINITY;
 }
+float Sphere::area() { return 4 * M_PI * radius * radius; }
+void Sphere::computeBounds(const vec3 &planeNormal, float &dnear, float &dfar) {
+  float d;
+  d = dot(planeNormal, vec3(c) + (planeNormal * radius));
+  if (d < dnear) dnear = d;
+  if (d > dfar) dfar = d;
+
+  d = dot(planeNormal, vec3(c) - (planeNormal * radius));
+  if (d < dnear) dnear = d;
+  if (d > dfar) dfar = d;
+}
@@ -1,7 +1,9 @@
 #include "post_processing.h"
 #include <iostream>
+#include <vector>
 
 using namespace cv;
+using glm::vec3;
 
 Mat cvUnpackDepthBuffer(screen *s) {
   Mat mat(s->height, s->width, CV_32F, Scalar(0));
@@ -38,3 +40,102 @@ void maskImage(cv::Mat im1, cv::Mat im2, cv::Mat mask, cv::Mat &out) {
     }
   }
 }
+
+/* DENOISER IMPLEMENTATION */
+// B3 spline taps for offsets 0, 1 and 2, spread 2^i pixels apart on the i-th
+// pass so five passes reach 64 pixels for the price of 25 taps each
+const float atrousKernel[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+const float sigmaLuminance = 4.f;
+const float sigmaNormal = 128.f;
+const float sigmaDepth = 0.02f;
+const vec3 luminanceWeights(0.2126f, 0.7152f, 0.0722f);
+
+// Black surfaces carry no texture to preserve, filter their light as is
+static vec3 demodulationAlbedo(vec3 albedo) {
+  return glm::mix(vec3(1), albedo, vec3(glm::greaterThan(albedo, vec3(1e-3f))));
+}
+
+void denoise(screen *s, int iterations) {
+  int size = s->width * s->height;
+  if (s->denoised == NULL) s->denoised = new vec3[size];
+  std::vector<vec3> illumination(size), filtered(size);
+  std::vector<float> variance(size), filteredVariance(size);
+
+  // Divide the albedo out so the filter only ever blurs lighting, along with
+  // the variance of each pixel's mean to tell noise from real edges
+#pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    float n = s->sampleCounts[i] > 0 ? s->sampleCounts[i] : 1;
+    vec3 albedo = demodulationAlbedo(s->albedo[i]);
+    vec3 mean = s->pixels[i] / n;
+    vec3 sampleVariance =
+        glm::max(s->pixelSquares[i] / n - mean * mean, vec3(0));
+    illumination[i] = mean / albedo;
+    variance[i] = glm::dot(sampleVariance / (n * albedo * albedo),
+                           luminanceWeights);
+  }
+
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    int step = 1 << iteration;
+#pragma omp parallel for
+    for (int y = 0; y < s->height; y++) {
+      for (int x = 0; x < s->width; x++) {
+        int p = y * s->width + x;
+        float depth = s->depthBuffer[p];
+        float luminance = glm::dot(illumination[p], luminanceWeights);
+        // A few samples say little about a pixel's variance, so it is
+        // smoothed over its 3x3 neighbourhood before use
+        float localVariance = 0, localWeight = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            int qx = x + dx, qy = y + dy;
+            if (qx < 0 || qx >= s->width || qy < 0 || qy >= s->height) {
+              continue;
+            }
+            float weight = (dx == 0 ? 2.f : 1.f) * (dy == 0 ? 2.f : 1.f);
+            localVariance += weight * variance[qy * s->width + qx];
+            localWeight += weight;
+          }
+        }
+        float luminanceScale =
+            sigmaLuminance * sqrtf(localVariance / localWeight) + 1e-6f;
+        vec3 sum = vec3(0);
+        float weightSum = 0, varianceSum = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+          for (int dx = -2; dx <= 2; dx++) {
+            int qx = x + dx * step;
+            int qy = y + dy * step;
+            if (qx < 0 || qx >= s->width || qy < 0 || qy >= s->height) {
+              continue;
+            }
+            int q = qy * s->width + qx;
+            float weight = atrousKernel[abs(dx)] * atrousKernel[abs(dy)];
+            if (q != p) {
+              float normal =
+                  glm::max(glm::dot(s->normals[p], s->normals[q]), 0.f);
+              float depthScale =
+                  sigmaDepth * step * sqrtf(dx * dx + dy * dy) * depth + 1e-6f;
+              weight *= powf(normal, sigmaNormal) *
+                        expf(-fabsf(depth - s->depthBuffer[q]) / depthScale -
+                             fabsf(luminance - glm::dot(illumination[q],
+                                                        luminanceWeights)) /
+                                 luminanceScale);
+            }
+            sum += weight * illumination[q];
+            weightSum += weight;
+            varianceSum += weight * weight * variance[q];
+          }
+        }
+        filtered[p] = sum / weightSum;
+        filteredVariance[p] = varianceSum / (weightSum * weightSum);
+      }
+    }
+    illumination.swap(filtered);
+    variance.swap(filteredVariance);
+  }
+
+#pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    s->denoised[i] = illumination[i] * demodulationAlbedo(s->albedo[i]);
+  }
+}
@@ -156,17 +156,17 @@ void createCoordinateSystem(const vec3 &N, vec3 &Nt, vec3 &Nb) {
 void PixelShader(screen *screen, const Pixel &p, const Primitive *primitive,
                  Camera *camera) {
   vec3 color;
-  if (primitive->material.diffuseTexture != NULL) {
-    color = primitive->material.diffuseTexture->sample(p.uv);
+  const Material &material = scene->material(primitive);
+  if (material.diffuseTexture != NULL) {
+    color = material.diffuseTexture->sample(p.uv);
   } else {
-    color = p.reflectance;
+    color = material.color;
   }
 
   vec4 normal;
-  if (primitive->material.bumpTexture != NULL) {
+  if (material.bumpTexture != NULL) {
     vec3 Nt, Nb;
-    vec3 sample =
-        (2.f * primitive->material.diffuseTexture->sample(p.uv)) - 1.f;
+    vec3 sample = (2.f * material.diffuseTexture->sample(p.uv)) - 1.f;
     createCoordinateSystem(vec3(p.normal), Nt, Nb);
     normal = vec4(mat3(Nb, vec3(p.normal), Nt) * sample, 0.f);
   } else {
@@ -1,10 +1,13 @@
 #include <SDL.h>
 #include <limits.h>
 #include <math.h>
+#include <omp.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <algorithm>
+#include <fstream>
 #include <climits>
 #include <cmath>
 #include <cstdint>
@@ -13,12 +16,17 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
-#include <random>
 #include "TestModel.h"
 #include "camera.h"
+#include "integrator.h"
 #include "objects.h"
+#include "post_processing.h"
+#include "render_settings.h"
+#include "sampler.h"
 #include "scene.h"
 #include "screen.h"
+#include "stats.h"
+#include "tile_scheduler.h"
 
 using namespace std;
 using glm::ivec2;
@@ -28,14 +36,20 @@ using glm::vec2;
 using glm::vec3;
 using glm::vec4;
 
-#define SCREEN_WIDTH 240
-#define SCREEN_HEIGHT 240
-#define FULLSCREEN_MODE false
-#define MIN_BOUNCES 5
-#define MAX_BOUNCES 10
-// #define AA
-#define BVH
-#define LIVE
+#define ADAPTIVE
+#define ADAPTIVE_MIN_SAMPLES 16
+#define ADAPTIVE_ERROR 0.05f
+#define ADAPTIVE_REFRESH 8
+#define PACKETS
+#define TILE_SIZE 8
+// #define WAVEFRONT
+#define SOBOL
+
+#ifdef SOBOL
+typedef SobolSampler PixelSampler;
+#else
+typedef PCGSampler PixelSampler;
+#endif
 
 float m = numeric_limits<float>::max();
 vec4 lightPos(0, -0.5, -0.7, 1.0);
@@ -48,282 +62,540 @@ float apertureSize = 0.2f;
 
 void Update(screen *screen);
 void Draw(screen *screen);
+void DrawTile(screen *screen, const Tile &tile);
+void RenderHeadless(screen *screen);
+void ReportFrameStats(double seconds);
+void PutFeatures(screen *screen, int x, int y,
+                 const Intersection &intersection);
+int CameraRays();
+vec4 CameraDirection(int x, int y, int sample, const mat4 &rotation);
 bool ClosestIntersection(vec4 start, vec4 dir,
                          Intersection &closestIntersection);
 mat3 CalcRotationMatrix(float x, float y, float z);
-vec3 uniformSampleHemisphere(const float &r1, const float &r2);
-vec3 sampleConeBase(float b);
-void createCoordinateSystem(const vec3 &N, vec3 &Nt, vec3 &Nb);
-vec3 Light(const vec4 start, const vec4 dir, float currIor = 1.f,
-           int bounce = 0);
-void fresnel(vec4 I, vec4 N, float ior, float &kr);
-float max3(vec3);
 void LoadModel(vector<Object *> &scene, const char *path);
 
+#ifdef WAVEFRONT
+void DrawWavefront(screen *screen);
+
+// A path waiting to be extended by its next ray. Paths are identified by their
+// index in the frame so results can be gathered back to the right pixel.
+struct PathState {
+  Ray ray;
+  vec3 throughput;
+  float ior;
+  int bounce;
+  // As in PathSegment, zero for camera rays and glass
+  float bsdfPdf;
+  uint32_t path;
+  PixelSampler sampler;
+};
+
+// Next event estimation sample, added to its path if the ray is unblocked
+struct ShadowRay {
+  Ray ray;
+  float maxDistance;
+  vec3 contribution;
+  uint32_t path;
+};
+#endif
+
 float samples = 0;
-Scene *scene;
 Camera *camera;
 
 int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+      PrintUsage(argv[0], cout);
+      return 0;
+    }
+  }
+  if (!ParseRenderSettings(argc, argv, settings, cerr)) {
+    PrintUsage(argv[0], cerr);
+    return 1;
+  }
+
   screen *screen =
-      InitializeSDL("raytracer", SCREEN_WIDTH, SCREEN_HEIGHT, FULLSCREEN_MODE);
+      settings.headless
+          ? createScreen("raytracer", settings.width, settings.height)
+          : InitializeSDL("raytracer", settings.width, settings.height,
+                          settings.fullscreen);
 
   scene = new Scene();
-  if (argc >= 2) {
-    const string path = argv[1];
-    scene->LoadModel(path);
+  if (!settings.scenePath.empty()) {
+    scene->LoadModel(settings.scenePath);
   } else {
     scene->LoadTest();
   }
 
-#ifdef BVH
-  scene->createBVH();
-#endif
+  if (settings.useBVH) {
+    string cachePath;
+    if (settings.bvhCache && !settings.scenePath.empty()) {
+      cachePath = settings.scenePath + ".bvh";
+    }
+    scene->createBVH(settings.bvhType, cachePath);
+  }
 
-  camera = new Camera(vec4(0, 0, -3.001, 1), vec3(0, 0, 0), SCREEN_HEIGHT,
+  camera = new Camera(vec4(0, 0, -3.001, 1), vec3(0, 0, 0), settings.height,
                       0.001, 0.001);
 
-  srand(42);
-#ifdef LIVE
-  while (NoQuitMessageSDL()) {
-    Update(screen);
-    Draw(screen);
-    SDL_Renderframe(screen);
-    SDL_SaveImage(screen, "screenshot.png");
+  if (settings.headless) {
+    RenderHeadless(screen);
+  } else {
+    while (NoQuitMessageSDL()) {
+      Update(screen);
+      Draw(screen);
+      if (settings.denoise) denoise(screen);
+      SDL_Renderframe(screen);
+    }
   }
-#else
-  Update();
-  Draw(screen);
-  SDL_Renderframe(screen);
-  Update();
-#endif
 
-  SDL_SaveImage(screen, "screenshot.png");
+  SDL_SaveImage(screen, settings.output.c_str());
 
   KillSDL(screen);
   return 0;
 }
 
+/* Renders without a window until the sample count or time budget is reached.
+ * Adaptive sampling skips converged tiles on most frames, so the sample count
+ * is the fewest camera rays any pixel has had, not the number of frames. The
+ * time budget is checked against the average frame so far, so the last frame
+ * is not started when it would clearly overrun. */
+void RenderHeadless(screen *screen) {
+  const int cameraRays = CameraRays();
+  const int pixelCount = settings.width * settings.height;
+  double start = omp_get_wtime();
+  double frameStart = start;
+  while (true) {
+    Draw(screen);
+    double end = omp_get_wtime();
+    double elapsed = end - start;
+    uint32_t fewest = UINT32_MAX;
+    double total = 0;
+    for (int i = 0; i < pixelCount; i++) {
+      fewest = min(fewest, screen->sampleCounts[i]);
+      total += screen->sampleCounts[i];
+    }
+    int minSamples = fewest * cameraRays;
+    cout << "Frame " << samples << ": " << minSamples << " spp at least, "
+         << total * cameraRays / pixelCount << " on average, in " << elapsed
+         << " s." << endl;
+    ReportFrameStats(end - frameStart);
+    frameStart = end;
+    if (settings.samplesPerPixel > 0 &&
+        minSamples >= settings.samplesPerPixel) {
+      break;
+    }
+    if (settings.timeBudget > 0 &&
+        elapsed + elapsed / samples > settings.timeBudget) {
+      break;
+    }
+  }
+  if (settings.denoise) denoise(screen);
+}
+
+// Prints the counters gathered since the last report, and appends them to the
+// stats file if there is one
+void ReportFrameStats(double seconds) {
+  FrameStats stats = CollectFrameStats(seconds);
+  stats.print(cout);
+  if (!settings.statsPath.empty()) {
+    ofstream file(settings.statsPath.c_str(), ios::app);
+    stats.writeJson(file);
+  }
+}
+
 /*Place your drawing here*/
 void Draw(screen *screen) {
   samples++;
 
-  int x, y;
-#pragma omp parallel for private(x, y) collapse(2)
-  for (y = -SCREEN_HEIGHT / 2; y < SCREEN_HEIGHT / 2; y++) {
-    for (x = -SCREEN_WIDTH / 2; x < SCREEN_WIDTH / 2; x++) {
-      vec3 color = vec3(0);
-#ifndef AA
-      vec4 direction = glm::normalize(vec4(x, y, camera->focalLength, 1) *
-                                      camera->getRotationMatrix());
-      color += Light(camera->position, direction);
+#ifdef WAVEFRONT
+  DrawWavefront(screen);
 #else
-      ivec2 samplePoints[4] = {
-          ivec2(x - apertureSize, y - apertureSize),
-          ivec2(x + apertureSize, y - apertureSize),
-          ivec2(x + apertureSize, y + apertureSize),
-          ivec2(x - apertureSize, y + apertureSize),
-      };
-      for (int i = 0; i < 4; i++) {
-        vec4 direction = glm::normalize(vec4((float)samplePoints[i].x,
-                                             (float)samplePoints[i].y,
-                                             camera->focalLength, 1) *
-                                        camera->getRotationMatrix());
-        color += Light(camera->position, direction);
+  static TileScheduler scheduler(settings.width, settings.height, TILE_SIZE);
+  scheduler.run([screen](const Tile &tile) { DrawTile(screen, tile); });
+  scheduler.printStats(cout);
+#endif
+}
+
+// Guide buffers for the denoiser from the first hit of pixel (x, y). Primary
+// rays never change between frames, so they are written once after a clear.
+void PutFeatures(screen *screen, int x, int y,
+                 const Intersection &intersection) {
+  Primitive *primitive = intersection.primitive;
+  if (primitive == NULL) return;
+  const Material &material = scene->material(primitive);
+  vec3 albedo = material.isLight() ? vec3(1) : material.color;
+  PutFeaturesSDL(screen, x, y, albedo, vec3(intersection.normal),
+                 intersection.distance);
+}
+
+void DrawTile(screen *screen, const Tile &tile) {
+#ifdef ADAPTIVE
+  // Once the tile's pixels have their means known well enough on average,
+  // later frames skip it. Path tracing noise is heavy tailed, so a single
+  // pixel often looks converged before its rare bright paths turn up; stopping
+  // pixels on their own estimate biases them dark. Averaging over the tile and
+  // sampling everything every few frames keeps those estimates honest.
+  if ((int)samples % ADAPTIVE_REFRESH != 0) {
+    float error = 0;
+    for (int y = tile.y; y < tile.y + tile.height; y++) {
+      for (int x = tile.x; x < tile.x + tile.width; x++) {
+        if (screen->sampleCounts[y * settings.width + x] < ADAPTIVE_MIN_SAMPLES) {
+          error = INFINITY;
+        }
+        error += PixelError(screen, x, y);
       }
-      color /= 5.f;
+    }
+    if (error < ADAPTIVE_ERROR * tile.width * tile.height) return;
+  }
 #endif
-      PutPixelSDL(screen, x + SCREEN_WIDTH / 2, y + SCREEN_HEIGHT / 2, color,
+
+  const int cameraRays = CameraRays();
+  const mat4 rotation = camera->getRotationMatrix();
+  int tileX = tile.x - settings.width / 2;
+  int tileY = tile.y - settings.height / 2;
+  int endX = tileX + tile.width;
+  int endY = tileY + tile.height;
+#ifdef PACKETS
+  // Primary rays are traced a tile at a time so neighbouring rays share their
+  // trip down the BVH; everything after the first hit is traced per pixel
+  vec3 colors[TILE_SIZE * TILE_SIZE] = {};
+  for (int i = 0; i < cameraRays; i++) {
+    RayPacket packet;
+    for (int y = tileY; y < endY; y++) {
+      for (int x = tileX; x < endX; x++) {
+        vec4 direction = CameraDirection(x, y, i, rotation);
+        Ray ray;
+        ray.position = camera->position + direction * 1e-4f;
+        ray.direction = direction;
+        packet.add(ray);
+      }
+    }
+
+    Intersection intersections[RayPacket::maxSize];
+    scene->intersect(packet, intersections);
+    STAT_ADD(STAT_CAMERA_RAYS, packet.size);
+    for (uint32_t j = 0; j < packet.size; j++) {
+      int x = tile.x + j % tile.width;
+      int y = tile.y + j / tile.width;
+      uint32_t sampleIndex = screen->sampleCounts[y * settings.width + x];
+      if (i == 0 && sampleIndex == 0) {
+        PutFeatures(screen, x, y, intersections[j]);
+      }
+      if (intersections[j].primitive != NULL) {
+        PixelSampler sampler;
+        sampler.startSample(x, y, sampleIndex * cameraRays + i);
+        colors[j] += Shade(intersections[j], packet.rays[j].direction, sampler);
+      }
+    }
+  }
+
+  for (int y = tileY; y < endY; y++) {
+    for (int x = tileX; x < endX; x++) {
+      vec3 color = colors[(y - tileY) * tile.width + (x - tileX)];
+      PutPixelSDL(screen, x + settings.width / 2, y + settings.height / 2,
+                  color / (float)cameraRays, samples);
+    }
+  }
+#else
+  for (int y = tileY; y < endY; y++) {
+    for (int x = tileX; x < endX; x++) {
+      int screenX = x + settings.width / 2;
+      int screenY = y + settings.height / 2;
+      uint32_t sampleIndex =
+          screen->sampleCounts[screenY * settings.width + screenX];
+      if (sampleIndex == 0) {
+        Ray ray;
+        ray.direction = CameraDirection(x, y, 0, rotation);
+        ray.position = camera->position + ray.direction * 1e-4f;
+        Intersection intersection;
+        if (scene->intersect(ray, intersection)) {
+          PutFeatures(screen, screenX, screenY, intersection);
+        }
+      }
+      vec3 color = vec3(0);
+      PixelSampler sampler;
+      STAT_ADD(STAT_CAMERA_RAYS, cameraRays);
+      for (int i = 0; i < cameraRays; i++) {
+        sampler.startSample(screenX, screenY, sampleIndex * cameraRays + i);
+        color += Light(camera->position, CameraDirection(x, y, i, rotation),
+                       sampler);
+      }
+      PutPixelSDL(screen, screenX, screenY, color / (float)cameraRays,
                   samples);
     }
   }
+#endif
 }
 
-/*Place updates of parameters here*/
-void Update(screen *screen) {
-  static int t = SDL_GetTicks();
-  /* Compute frame time */
-  int t2 = SDL_GetTicks();
-  float dt = float(t2 - t);
-  t = t2;
-  cout << "Render time: " << dt << " ms." << endl;
-  /* Update variables*/
+// Camera rays traced per pixel each frame
+int CameraRays() { return settings.antialiasing ? 4 : 1; }
 
-  if (camera->update(dt)) {
-    clear(screen);
-    samples = 0;
+// Direction of camera ray `sample` through pixel (x, y), in coordinates
+// centred on the middle of the screen
+vec4 CameraDirection(int x, int y, int sample, const mat4 &rotation) {
+  ivec2 samplePoint(x, y);
+  if (settings.antialiasing) {
+    ivec2 samplePoints[4] = {
+        ivec2(x - apertureSize, y - apertureSize),
+        ivec2(x + apertureSize, y - apertureSize),
+        ivec2(x + apertureSize, y + apertureSize),
+        ivec2(x - apertureSize, y + apertureSize),
+    };
+    samplePoint = samplePoints[sample];
   }
+  return glm::normalize(vec4((float)samplePoint.x, (float)samplePoint.y,
+                             camera->focalLength, 1) *
+                        rotation);
 }
 
-std::default_random_engine generator;
-std::uniform_real_distribution<float> distribution(0, 1);
+#ifdef WAVEFRONT
+/* Breadth first integrator: every camera ray of the frame is generated up
+ * front, then each bounce runs as a sequence of passes over the whole queue of
+ * live paths (extend, shade, shadow, accumulate) with dead paths compacted out
+ * between bounces. Glass picks one of reflection or refraction by the Fresnel
+ * term so every path stays a single ray. */
+void DrawWavefront(screen *screen) {
+  const int samplesPerPixel = CameraRays();
+  const int tilesX = (settings.width + TILE_SIZE - 1) / TILE_SIZE;
+  const int tilesY = (settings.height + TILE_SIZE - 1) / TILE_SIZE;
+  const uint32_t pathCount = settings.width * settings.height * samplesPerPixel;
+  const uint32_t tileSlots = TILE_SIZE * TILE_SIZE * samplesPerPixel;
+  // Camera space coordinates run from -width / 2 up to, not including, these
+  const int endWidth = settings.width - settings.width / 2;
+  const int endHeight = settings.height - settings.height / 2;
 
-vec3 Light(const vec4 start, const vec4 dir, float currIor, int bounce) {
-  Intersection intersection;
-  Ray ray;
+  // Kept between frames to avoid reallocating the queues every time
+  static vector<PathState> paths, nextPaths;
+  static vector<Intersection> intersections;
+  static vector<ShadowRay> shadowRays;
+  static vector<uint8_t> nextValid, shadowValid;
+  static vector<vec3> radiance;
+  static vector<uint32_t> pathPixels;
 
-  ray.position = start + dir * 1e-4f;
-  ray.direction = dir;
-  if (scene->intersect(ray, intersection)) {
-    // Russian roulette termination
-    float U = rand() / (float)RAND_MAX;
-    if (intersection.primitive->isLight()) {
-      return intersection.primitive->material.emission;
+  const uint32_t lightCount = scene->emitters.empty() ? 0 : LIGHT_SAMPLES;
+
+  // Generate camera rays tile by tile, so that consecutive runs of the queue
+  // are coherent enough to be traced as packets
+  paths.resize(tilesX * tilesY * tileSlots);
+  pathPixels.resize(tilesX * tilesY * tileSlots);
+  radiance.assign(pathCount, vec3(0));
+  const mat4 rotation = camera->getRotationMatrix();
+#pragma omp parallel for schedule(dynamic)
+  for (int tile = 0; tile < tilesX * tilesY; tile++) {
+    int tileX = -settings.width / 2 + (tile % tilesX) * TILE_SIZE;
+    int tileY = -settings.height / 2 + (tile / tilesX) * TILE_SIZE;
+    int endX = min(tileX + TILE_SIZE, endWidth);
+    int endY = min(tileY + TILE_SIZE, endHeight);
+    uint32_t path = tile * tileSlots;
+    for (int i = 0; i < samplesPerPixel; i++) {
+      for (int y = tileY; y < endY; y++) {
+        for (int x = tileX; x < endX; x++) {
+          vec4 direction = CameraDirection(x, y, i, rotation);
+          PathState &state = paths[path];
+          state.ray.position = camera->position + direction * 1e-4f;
+          state.ray.direction = direction;
+          state.throughput = vec3(1);
+          state.ior = 1.f;
+          state.bounce = 0;
+          state.bsdfPdf = 0;
+          state.path = path;
+          state.sampler.startSample(
+              x + settings.width / 2, y + settings.height / 2,
+              (uint32_t)(samples - 1) * samplesPerPixel + i);
+          pathPixels[path] = (y + settings.height / 2) * settings.width +
+                             (x + settings.width / 2);
+          path++;
+        }
+      }
     }
-    if ((bounce > MIN_BOUNCES &&
-         (bounce > MAX_BOUNCES ||
-          U > max3(intersection.primitive->material.color)))) {
-      // terminate
-      return vec3(0);
+  }
+
+  STAT_ADD(STAT_CAMERA_RAYS, pathCount);
+  uint32_t activeCount = 0;
+  for (int tile = 0; tile < tilesX * tilesY; tile++) {
+    // Partial tiles on the screen edge leave gaps in the queue
+    int tileX = -settings.width / 2 + (tile % tilesX) * TILE_SIZE;
+    int tileY = -settings.height / 2 + (tile / tilesX) * TILE_SIZE;
+    int size = (min(tileX + TILE_SIZE, endWidth) - tileX) *
+               (min(tileY + TILE_SIZE, endHeight) - tileY) *
+               samplesPerPixel;
+    uint32_t first = tile * tileSlots;
+    for (int i = 0; i < size; i++) {
+      pathPixels[activeCount] = pathPixels[first + i];
+      paths[activeCount] = paths[first + i];
+      paths[activeCount].path = activeCount;
+      activeCount++;
     }
+  }
 
-    vec4 hitPos = intersection.position;
-    vec4 normal = intersection.primitive->getNormal(hitPos);
-
-    // Direct Light
-    vec3 directDiffuseLight = vec3(0);
-    vec3 directSpecularLight = vec3(0);
-    for (Object *object : scene->objects) {
-      for (Primitive *light : object->primitives) {
-        if (light->isLight()) {
-          vec4 lightPos = light->randomPoint();
-          vec4 lightVec = lightPos - hitPos;
-          float lightDist = glm::length(lightVec);
-          vec4 lightDir = lightVec / lightDist;
-          Intersection lightIntersection;
-
-          ray.position = hitPos + lightDir * 1e-4f;
-          ray.direction = lightDir;
-          if (scene->intersect(ray, lightIntersection)) {
-            if (light == lightIntersection.primitive) {
-              vec4 reflected = glm::reflect(lightDir, normal);
-              directSpecularLight +=
-                  light->material.emission *
-                  max(powf(glm::dot(reflected, dir),
-                           intersection.primitive->material.shininess),
-                      0.0f) *
-                  max(glm::dot(lightDir, normal), 0.0f) /
-                  (float)(4 * M_PI * powf(lightDist, 2));
-              directDiffuseLight += light->material.emission *
-                                    max(glm::dot(lightDir, normal), 0.0f) /
-                                    (float)(4 * M_PI * powf(lightDist, 2));
-            }
-          }
-        }
+  while (activeCount > 0) {
+    // Extend: closest hit for every live path, a packet's worth at a time
+    intersections.resize(activeCount);
+    const uint32_t chunkCount =
+        (activeCount + RayPacket::maxSize - 1) / RayPacket::maxSize;
+#pragma omp parallel for schedule(dynamic)
+    for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+      uint32_t first = chunk * RayPacket::maxSize;
+      uint32_t last = min(first + RayPacket::maxSize, activeCount);
+      RayPacket packet;
+      for (uint32_t i = first; i < last; i++) packet.add(paths[i].ray);
+      scene->intersect(packet, &intersections[first]);
+    }
+    for (uint32_t i = 0; i < activeCount; i++) {
+      uint32_t pixel = pathPixels[paths[i].path];
+      if (paths[i].bounce == 0 && screen->sampleCounts[pixel] == 0) {
+        PutFeatures(screen, pixel % settings.width, pixel / settings.width,
+                    intersections[i]);
       }
     }
-    directSpecularLight = glm::clamp(directSpecularLight, vec3(0), vec3(1));
-    directDiffuseLight = glm::clamp(directDiffuseLight, vec3(0), vec3(1));
-
-    // Indirect Light
-    vec3 indirectLight = vec3(0);
-    float prob = dot(intersection.primitive->material.diffuse /
-                         (intersection.primitive->material.diffuse +
-                          intersection.primitive->material.diffuse),
-                     vec3(1.f / 3.f));
-    if (intersection.primitive->material.transmittance.x > 0 ||
-        intersection.primitive->material.transmittance.y > 0 ||
-        intersection.primitive->material.transmittance.z > 0) {
-      vec3 refractionColor;
-      float kr;
-      fresnel(dir, normal, intersection.primitive->material.refractiveIndex,
-              kr);
-      bool isInside = glm::dot(dir, normal) > 0;
-      vec4 bias = 1e-4f * normal;
-      float eta = !isInside
-                      ? 1.f / intersection.primitive->material.refractiveIndex
-                      : intersection.primitive->material.refractiveIndex;
-      float newIor =
-          isInside ? 1.f : intersection.primitive->material.refractiveIndex;
-      normal = isInside ? -normal : normal;
-      if (kr < 1) {
-        vec4 refracted = glm::normalize(glm::refract(dir, normal, eta));
-        vec4 start = isInside ? hitPos + bias : hitPos - bias;
-        refractionColor = Light(start, refracted, newIor, bounce + 1);
+
+    // Shade: emission, shadow rays towards sampled lights, next bounce
+    nextPaths.resize(activeCount);
+    nextValid.assign(activeCount, 0);
+    shadowRays.resize(activeCount * lightCount);
+    shadowValid.assign(activeCount * lightCount, 0);
+#pragma omp parallel for schedule(dynamic, 256)
+    for (uint32_t i = 0; i < activeCount; i++) {
+      const Intersection &intersection = intersections[i];
+      PathState &state = paths[i];
+      if (intersection.primitive == NULL) continue;
+      STAT_ADD(STAT_PATHS, state.bounce == 0);
+      STAT_ADD(STAT_PATH_VERTICES, 1);
+      const Material &material = scene->material(intersection.primitive);
+      const vec4 dir = state.ray.direction;
+      if (material.isLight()) {
+        radiance[state.path] +=
+            state.throughput * material.emission *
+            EmissionWeight(intersection, dir, state.bsdfPdf);
+        continue;
       }
-      vec4 reflected = glm::normalize(glm::reflect(dir, normal));
-      vec4 start = isInside ? hitPos + bias : hitPos - bias;
-      vec3 reflectionColor = Light(start, reflected, newIor, bounce + 1);
-      indirectLight += kr * reflectionColor + (1 - kr) * refractionColor;
-    } else if ((rand() / (float)RAND_MAX) < prob) {
-      // diffuse
-      vec3 Nt, Nb;
-      float r1 = distribution(generator);
-      float r2 = distribution(generator);
-      vec3 sample = uniformSampleHemisphere(r1, r2);
-      createCoordinateSystem(vec3(normal), Nt, Nb);
-      vec3 sampleWorld = vec3(mat3(Nb, vec3(normal), Nt) * sample);
-      vec4 rayDir = vec4(sampleWorld, 1);
-      indirectLight +=
-          Light(hitPos, rayDir,
-                intersection.primitive->material.refractiveIndex, bounce + 1);
-    } else {
-      // specular
-      vec3 Nt, Nb;
-      vec4 reflected = glm::reflect(dir, normal);
-      createCoordinateSystem(vec3(reflected), Nt, Nb);
-      vec3 sample =
-          sampleConeBase(10.f / intersection.primitive->material.shininess);
-      vec3 sampleWorld = vec3(mat3(Nb, vec3(reflected), Nt) * sample);
-      vec4 rayDir = glm::normalize(vec4(sampleWorld, 1));
-      indirectLight +=
-          Light(hitPos, rayDir,
-                intersection.primitive->material.refractiveIndex, bounce + 1);
+
+      // Russian roulette termination, as in Shade
+      float survival = 1;
+      if (state.bounce > settings.minBounces) {
+        survival = state.bounce > settings.maxBounces
+                       ? 0.f
+                       : min(max3(state.throughput * material.color), 1.f);
+      }
+      if (state.sampler.get1D() >= survival) {
+        STAT_ADD(STAT_ROULETTE_TERMINATIONS, survival > 0);
+        continue;
+      }
+      state.throughput /= survival;
+
+      vec4 hitPos = intersection.position;
+      vec4 normal = intersection.normal;
+      PathState &next = nextPaths[i];
+      next.throughput = state.throughput;
+      next.bounce = state.bounce + 1;
+      next.path = state.path;
+      next.sampler = state.sampler;
+      vec4 start = hitPos;
+      vec4 rayDir;
+      if (material.transmittance.x > 0 || material.transmittance.y > 0 ||
+          material.transmittance.z > 0) {
+        next.throughput *= material.color;
+        next.bsdfPdf = 0;
+        float kr;
+        fresnel(dir, normal, material.refractiveIndex, kr);
+        bool isInside = glm::dot(dir, normal) > 0;
+        vec4 bias = 1e-4f * normal;
+        float eta = !isInside ? 1.f / material.refractiveIndex
+                              : material.refractiveIndex;
+        next.ior = isInside ? 1.f : material.refractiveIndex;
+        normal = isInside ? -normal : normal;
+        start = isInside ? hitPos + bias : hitPos - bias;
+        if (kr < 1 && next.sampler.get1D() >= kr) {
+          rayDir = glm::normalize(glm::refract(dir, normal, eta));
+          STAT_ADD(STAT_REFRACTION_RAYS, 1);
+        } else {
+          rayDir = glm::normalize(glm::reflect(dir, normal));
+          STAT_ADD(STAT_SPECULAR_RAYS, 1);
+        }
+      } else {
+        vec3 wo = glm::normalize(vec3(dir));
+        vec3 n = vec3(normal);
+        if (dot(wo, n) > 0) n = -n;
+        for (uint32_t j = 0; j < lightCount; j++) {
+          ShadowRay &shadowRay = shadowRays[i * lightCount + j];
+          if (SampleDirectLight(material, hitPos, wo, n, next.sampler,
+                                shadowRay.ray, shadowRay.maxDistance,
+                                shadowRay.contribution)) {
+            shadowRay.contribution *= state.throughput;
+            shadowRay.path = state.path;
+            shadowValid[i * lightCount + j] = 1;
+            STAT_ADD(STAT_SHADOW_RAYS, 1);
+          }
+        }
+
+        BSDFSample sample;
+        if (!SampleBSDF(material, wo, n, next.sampler, sample)) continue;
+        next.throughput *= sample.weight;
+        next.bsdfPdf = sample.pdf;
+        next.ior = material.refractiveIndex;
+        rayDir = vec4(sample.direction, 0);
+        STAT_ADD(sample.specular ? STAT_SPECULAR_RAYS : STAT_DIFFUSE_RAYS, 1);
+      }
+      next.ray.position = start + rayDir * 1e-4f;
+      next.ray.direction = rayDir;
+      nextValid[i] = 1;
     }
-    indirectLight = glm::clamp(indirectLight, vec3(0), vec3(10));
 
-    return intersection.primitive->material.color *
-           (intersection.primitive->material.diffuse * directDiffuseLight +
-            intersection.primitive->material.ambient * indirectLight +
-            intersection.primitive->material.specular * directSpecularLight);
-  }
-  return vec3(0);
-}
+    // Compact the shadow and bounce queues in place
+    uint32_t shadowCount = 0;
+    for (uint32_t i = 0; i < activeCount * lightCount; i++) {
+      if (shadowValid[i]) shadowRays[shadowCount++] = shadowRays[i];
+    }
+    uint32_t nextCount = 0;
+    for (uint32_t i = 0; i < activeCount; i++) {
+      if (nextValid[i]) nextPaths[nextCount++] = nextPaths[i];
+    }
 
-vec3 uniformSampleHemisphere(const float &r1, const float &r2) {
-  float sinTheta = sqrtf(1 - r1 * r1);
-  float phi = 2 * M_PI * r2;
-  float x = sinTheta * cosf(phi);
-  float z = sinTheta * sinf(phi);
-  return vec3(x, r1, z);
-}
+    // Shadow: any hit test of every light sample
+    shadowValid.resize(shadowCount);
+#pragma omp parallel for schedule(dynamic, 256)
+    for (uint32_t i = 0; i < shadowCount; i++) {
+      shadowValid[i] =
+          !scene->occluded(shadowRays[i].ray, shadowRays[i].maxDistance);
+    }
 
-void createCoordinateSystem(const vec3 &N, vec3 &Nt, vec3 &Nb) {
-  if (fabs(N.x) > fabs(N.y))
-    Nt = glm::normalize(vec3(N.z, 0, -N.x));
-  else
-    Nt = glm::normalize(vec3(0, -N.z, N.y));
-  Nb = glm::cross(N, Nt);
-}
+    // Accumulate: several shadow rays can land on the same path, so this pass
+    // stays serial
+    for (uint32_t i = 0; i < shadowCount; i++) {
+      if (shadowValid[i]) {
+        radiance[shadowRays[i].path] += shadowRays[i].contribution;
+      }
+    }
 
-vec3 sampleConeBase(float b) {
-  float r = b * sqrt(rand() / (float)RAND_MAX);
-  float t = 2 * M_PI * (rand() / (float)RAND_MAX);
-  return vec3(r * cos(t), 1, r * sin(t));
-}
+    paths.swap(nextPaths);
+    activeCount = nextCount;
+  }
 
-void fresnel(vec4 I, vec4 N, float ior, float &kr) {
-  float cosi = glm::clamp(glm::dot(I, N), -1.f, 1.f);
-  float etai = 1, etat = ior;
-  if (cosi > 0) {
-    swap(etai, etat);
+  vector<vec3> colors(settings.width * settings.height, vec3(0));
+  for (uint32_t i = 0; i < pathCount; i++) {
+    colors[pathPixels[i]] += radiance[i];
   }
-  // Compute sini using Snell's law
-  float sint = etai / etat * sqrtf(max(0.f, 1 - powf(cosi, 2.f)));
-  // Total internal reflection
-  if (sint >= 1) {
-    kr = 1;
-  } else {
-    float cost = sqrtf(max(0.f, 1 - powf(sint, 2.f)));
-    cosi = fabsf(cosi);
-    float Rs =
-        ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-    float Rp =
-        ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-    kr = (Rs * Rs + Rp * Rp) / 2;
+#pragma omp parallel for
+  for (int i = 0; i < settings.width * settings.height; i++) {
+    PutPixelSDL(screen, i % settings.width, i / settings.width,
+                colors[i] / (float)samplesPerPixel, samples);
   }
-  // As a consequence of the conservation of energy, transmittance is given by:
-  // kt = 1 - kr;
 }
+#endif
+
+/*Place updates of parameters here*/
+void Update(screen *screen) {
+  static int t = SDL_GetTicks();
+  /* Compute frame time */
+  int t2 = SDL_GetTicks();
+  float dt = float(t2 - t);
+  t = t2;
+  ReportFrameStats(dt / 1000);
+  /* Update variables*/
 
-float max3(vec3 v) { return max(v.x, max(v.y, v.z)); }
\ No newline at end of file
+  if (camera->update(dt)) {
+    clear(screen);
+    samples = 0;
+  }
+}
\ No newline at end of file
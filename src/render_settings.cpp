@@ -0,0 +1,147 @@
+#include "render_settings.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+// Parses the value following option `name`, advancing i past it
+static bool readInt(int argc, char *argv[], int &i, int &value, int min,
+                    int max, ostream &error) {
+  const char *name = argv[i];
+  if (++i >= argc) {
+    error << name << " needs a value" << endl;
+    return false;
+  }
+  char *end;
+  long parsed = strtol(argv[i], &end, 10);
+  if (*end != '\0' || parsed < min || parsed > max) {
+    error << name << " expects an integer from " << min << " to " << max
+          << ", got " << argv[i] << endl;
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+static bool readFloat(int argc, char *argv[], int &i, float &value,
+                      ostream &error) {
+  const char *name = argv[i];
+  if (++i >= argc) {
+    error << name << " needs a value" << endl;
+    return false;
+  }
+  char *end;
+  value = strtof(argv[i], &end);
+  if (*end != '\0' || value < 0) {
+    error << name << " expects a positive number, got " << argv[i] << endl;
+    return false;
+  }
+  return true;
+}
+
+bool ParseRenderSettings(int argc, char *argv[], RenderSettings &settings,
+                         ostream &error) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool ok = true;
+    if (!strcmp(arg, "--headless")) {
+      settings.headless = true;
+    } else if (!strcmp(arg, "--width")) {
+      ok = readInt(argc, argv, i, settings.width, 2, 16384, error);
+    } else if (!strcmp(arg, "--height")) {
+      ok = readInt(argc, argv, i, settings.height, 2, 16384, error);
+    } else if (!strcmp(arg, "--fullscreen")) {
+      settings.fullscreen = true;
+    } else if (!strcmp(arg, "--spp")) {
+      ok = readInt(argc, argv, i, settings.samplesPerPixel, 1, INT_MAX,
+                   error);
+    } else if (!strcmp(arg, "--time")) {
+      ok = readFloat(argc, argv, i, settings.timeBudget, error);
+    } else if (!strcmp(arg, "--min-bounces")) {
+      ok = readInt(argc, argv, i, settings.minBounces, 0, MAX_BOUNCES_LIMIT,
+                   error);
+    } else if (!strcmp(arg, "--max-bounces")) {
+      ok = readInt(argc, argv, i, settings.maxBounces, 0, MAX_BOUNCES_LIMIT,
+                   error);
+    } else if (!strcmp(arg, "--aa")) {
+      settings.antialiasing = true;
+    } else if (!strcmp(arg, "--bvh")) {
+      if (++i >= argc) {
+        error << "--bvh needs a value" << endl;
+        return false;
+      }
+      settings.useBVH = true;
+      if (!strcmp(argv[i], "none")) {
+        settings.useBVH = false;
+      } else if (!strcmp(argv[i], "octree")) {
+        settings.bvhType = BVH_OCTREE;
+      } else if (!strcmp(argv[i], "sah")) {
+        settings.bvhType = BVH_SAH;
+      } else if (!strcmp(argv[i], "wide")) {
+        settings.bvhType = BVH_WIDE;
+      } else {
+        error << "Unknown BVH type " << argv[i] << endl;
+        return false;
+      }
+    } else if (!strcmp(arg, "--no-bvh-cache")) {
+      settings.bvhCache = false;
+    } else if (!strcmp(arg, "--no-denoise")) {
+      settings.denoise = false;
+    } else if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
+      if (++i >= argc) {
+        error << arg << " needs a value" << endl;
+        return false;
+      }
+      settings.output = argv[i];
+    } else if (!strcmp(arg, "--stats")) {
+      if (++i >= argc) {
+        error << arg << " needs a value" << endl;
+        return false;
+      }
+      settings.statsPath = argv[i];
+    } else if (arg[0] == '-') {
+      error << "Unknown option " << arg << endl;
+      return false;
+    } else if (settings.scenePath.empty()) {
+      settings.scenePath = arg;
+    } else {
+      error << "Only one scene can be rendered at a time" << endl;
+      return false;
+    }
+    if (!ok) return false;
+  }
+
+  if (settings.minBounces > settings.maxBounces) {
+    error << "--min-bounces can not be more than --max-bounces" << endl;
+    return false;
+  }
+  if (settings.headless && settings.samplesPerPixel == 0 &&
+      settings.timeBudget == 0) {
+    error << "Headless renders need --spp or --time to know when to stop"
+          << endl;
+    return false;
+  }
+  return true;
+}
+
+void PrintUsage(const char *program, ostream &out) {
+  out << "Usage: " << program << " [options] [scene.obj | scene.scene]\n"
+      << "  --headless          render to the output file without a window\n"
+      << "  --spp N             stop once every pixel has had at least N\n"
+      << "                      camera rays\n"
+      << "  --time SECONDS      stop once this much time has been spent\n"
+      << "  -o, --output FILE   image to write (default screenshot.png)\n"
+      << "  --width N           image width (default 240)\n"
+      << "  --height N          image height (default 240)\n"
+      << "  --fullscreen        open the window fullscreen\n"
+      << "  --min-bounces N     bounces before Russian roulette (default 5)\n"
+      << "  --max-bounces N     bounces before paths are cut off (default 10)\n"
+      << "  --aa                four offset camera rays per pixel\n"
+      << "  --bvh TYPE          none, octree, sah or wide (default wide)\n"
+      << "  --no-bvh-cache      always build the BVH, without reading or\n"
+      << "                      writing scene.obj.bvh\n"
+      << "  --no-denoise        show and save the raw accumulated image\n"
+      << "  --stats FILE        append each frame's counters to FILE as JSON\n";
+}
@@ -0,0 +1,103 @@
+#include "sampler.h"
+
+using glm::vec2;
+
+// Largest float below one, so scaled 32 bit integers never round up to 1
+const float oneMinusEpsilon = 0.99999994f;
+
+static float toUnitFloat(uint32_t x) {
+  return glm::min(x * 2.3283064365386963e-10f, oneMinusEpsilon);
+}
+
+// Integer hash from the PCG family, good enough to seed from pixel coordinates
+static uint32_t hash(uint32_t x) {
+  uint32_t state = x * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+  return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+/* PCG SAMPLER IMPLEMENTATION */
+void PCGSampler::startSample(uint32_t x, uint32_t y, uint32_t index) {
+  // Pixel picks the stream, sample index the starting point within it
+  uint64_t stream = ((uint64_t)x << 32) | y;
+  state = 0;
+  increment = (stream << 1u) | 1u;
+  next();
+  state += hash(index) | ((uint64_t)index << 32);
+  next();
+}
+
+uint32_t PCGSampler::next() {
+  uint64_t old = state;
+  state = old * 6364136223846793005ULL + increment;
+  uint32_t xorShifted = ((old >> 18u) ^ old) >> 27u;
+  uint32_t rot = old >> 59u;
+  return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+}
+
+float PCGSampler::get1D() { return toUnitFloat(next()); }
+
+vec2 PCGSampler::get2D() {
+  float u = get1D();
+  return vec2(u, get1D());
+}
+
+/* SOBOL SAMPLER IMPLEMENTATION */
+static uint32_t reverseBits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Laine-Karras style hash that only lets bits flow from low to high, which
+// makes it a nested uniform scramble when applied to the reversed bits
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+  return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// First two Sobol dimensions: van der Corput, and the dimension whose
+// direction numbers are v[0] = 1 << 31, v[i] = v[i - 1] ^ (v[i - 1] >> 1)
+static void sobol2D(uint32_t index, uint32_t &x, uint32_t &y) {
+  x = reverseBits(index);
+  y = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) y ^= v;
+  }
+}
+
+void SobolSampler::startSample(uint32_t x, uint32_t y, uint32_t index) {
+  seed = hash(hashCombine(hash(x), y));
+  this->index = index;
+  dimension = 0;
+}
+
+float SobolSampler::get1D() {
+  uint32_t dimensionSeed = hash(hashCombine(seed, dimension++));
+  uint32_t i = nestedUniformScramble(index, dimensionSeed);
+  return toUnitFloat(nestedUniformScramble(reverseBits(i), dimensionSeed));
+}
+
+vec2 SobolSampler::get2D() {
+  uint32_t dimensionSeed = hash(hashCombine(seed, dimension++));
+  uint32_t i = nestedUniformScramble(index, dimensionSeed);
+  uint32_t x, y;
+  sobol2D(i, x, y);
+  x = nestedUniformScramble(x, hashCombine(dimensionSeed, 0));
+  y = nestedUniformScramble(y, hashCombine(dimensionSeed, 1));
+  return vec2(toUnitFloat(x), toUnitFloat(y));
+}
@@ -1,8 +1,14 @@
+#include <string.h>
+#include <functional>
 #include <iostream>
+#include <set>
 
 #include "TestModel.h"
 #include "bvh.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
 #include "scene.h"
+#include "scene_file.h"
 #include "tiny_obj_loader.h"
 
 #include <glm/gtx/string_cast.hpp>
@@ -25,11 +31,45 @@ Scene::Scene() {
 
 Scene::Scene(vector<Object *> objects) : objects(objects) {}
 
+Scene::~Scene() {
+  delete bvh;
+  delete worldBVH;
+  for (auto &mesh : meshBVHs) delete mesh.second;
+  // A mesh may be placed by several instances, and be one of the objects too
+  set<Object *> owned(objects.begin(), objects.end());
+  for (Instance *instance : instances) {
+    owned.insert(instance->mesh);
+    delete instance;
+  }
+  for (Object *object : owned) {
+    for (Primitive *primitive : object->primitives) {
+      if (!inTriangleBlock(primitive)) delete primitive;
+    }
+    delete object;
+  }
+}
+
+bool Scene::inTriangleBlock(const Primitive *primitive) const {
+  less<const Primitive *> before;
+  for (const vector<Triangle> &block : triangleBlocks) {
+    if (block.empty()) continue;
+    if (!before(primitive, &block.front()) && !before(&block.back(), primitive))
+      return true;
+  }
+  return false;
+}
+
 bool Scene::intersect(Ray ray, Intersection &intersection) {
   if (bvh != NULL) {
-    return bvh->intersect(ray, intersection);
+    if (!bvh->intersect(ray, intersection)) return false;
+    // The top level fills in normals itself, as only it knows the transforms
+    if (meshBVHs.empty()) {
+      intersection.normal =
+          intersection.primitive->getNormal(intersection.position);
+    }
+    return true;
   } else {
-      bool intersected = false;
+    bool intersected = false;
     float minDist = INFINITY;
     for (uint32_t i = 0; i < objects.size(); ++i) {
       Intersection intersect;
@@ -37,17 +77,189 @@ bool Scene::intersect(Ray ray, Intersection &intersection) {
         intersected = true;
         if (intersect.distance < minDist) {
           intersection = intersect;
+          intersection.normal = intersect.primitive->getNormal(
+              intersect.position);
           minDist = intersect.distance;
         }
       }
     }
+    for (uint32_t i = 0; i < instances.size(); ++i) {
+      Intersection intersect;
+      if (instances[i]->intersect(ray, intersect) &&
+          intersect.distance < minDist) {
+        intersected = true;
+        intersection = intersect;
+        minDist = intersect.distance;
+      }
+    }
     return intersected;
   }
 }
 
-void Scene::createBVH() { bvh = new BVH(objects); }
+void Scene::intersect(const RayPacket &packet, Intersection *intersections) {
+  if (bvh != NULL) {
+    bvh->intersect(packet, intersections);
+    if (meshBVHs.empty()) {
+      for (uint32_t i = 0; i < packet.size; ++i) {
+        if (intersections[i].primitive == NULL) continue;
+        intersections[i].normal = intersections[i].primitive->getNormal(
+            intersections[i].position);
+      }
+    }
+  } else {
+    for (uint32_t i = 0; i < packet.size; ++i) {
+      intersections[i].distance = INFINITY;
+      intersections[i].primitive = NULL;
+      intersect(packet.rays[i], intersections[i]);
+    }
+  }
+}
+
+bool Scene::occluded(Ray ray, float maxDistance) {
+  if (bvh != NULL) {
+    return bvh->occluded(ray, maxDistance);
+  } else {
+    for (uint32_t i = 0; i < objects.size(); ++i) {
+      for (uint32_t j = 0; j < objects[i]->primitives.size(); ++j) {
+        if (objects[i]->primitives[j]->intersect(ray) < maxDistance)
+          return true;
+      }
+    }
+    for (uint32_t i = 0; i < instances.size(); ++i) {
+      if (instances[i]->occluded(ray, maxDistance)) return true;
+    }
+    return false;
+  }
+}
+
+static AccelerationStructure *buildStructure(BVHType type,
+                                             vector<Object *> objects) {
+  switch (type) {
+    case BVH_OCTREE:
+      return new BVH(objects);
+    case BVH_SAH:
+      return new SAHBVH(objects);
+    case BVH_WIDE:
+    default:
+      return new WideBVH(objects);
+  }
+}
 
-void Scene::LoadTest() { LoadTestModel(objects); }
+void Scene::createBVH(BVHType type, const string &cachePath) {
+  delete bvh;
+  delete worldBVH;
+  for (auto &mesh : meshBVHs) delete mesh.second;
+  bvh = worldBVH = NULL;
+  meshBVHs.clear();
+  bvhType = type;
+  if (instances.empty()) {
+    if (!cachePath.empty()) bvh = LoadBVHCache(cachePath, type, objects);
+    if (bvh == NULL) {
+      bvh = buildStructure(type, objects);
+      if (!cachePath.empty()) SaveBVHCache(cachePath, bvh, objects);
+    }
+    return;
+  }
+
+  // Instances of the same mesh share its structure
+  if (!objects.empty()) worldBVH = buildStructure(type, objects);
+  for (Instance *instance : instances) {
+    AccelerationStructure *&blas = meshBVHs[instance->mesh];
+    if (blas == NULL) blas = buildStructure(type, {instance->mesh});
+    instance->blas = blas;
+  }
+  bvh = new TopLevelBVH(worldBVH, instances);
+}
+
+Instance *Scene::addInstance(Object *mesh, const glm::mat4 &transform) {
+  instances.push_back(new Instance(mesh, transform));
+  return instances.back();
+}
+
+void Scene::moveInstance(uint32_t index, const glm::mat4 &transform) {
+  instances[index]->setTransform(transform);
+  if (!meshBVHs.empty()) {
+    delete bvh;
+    bvh = new TopLevelBVH(worldBVH, instances);
+  }
+}
+
+// Refits structure over geometry, building it again if that is not possible
+// or not good enough
+static bool update(AccelerationStructure *&structure, BVHType type,
+                   const vector<Object *> &geometry, float rebuildRatio) {
+  if (structure->refit() &&
+      structure->sahCost() <= rebuildRatio * structure->builtCost) {
+    return false;
+  }
+  delete structure;
+  structure = buildStructure(type, geometry);
+  return true;
+}
+
+bool Scene::updateBVH(float rebuildRatio) {
+  if (bvh == NULL) {
+    for (Instance *instance : instances) instance->updateBounds();
+    return false;
+  }
+  if (meshBVHs.empty()) return update(bvh, bvhType, objects, rebuildRatio);
+
+  bool rebuilt = false;
+  if (worldBVH != NULL) {
+    rebuilt |= update(worldBVH, bvhType, objects, rebuildRatio);
+  }
+  for (auto &mesh : meshBVHs) {
+    rebuilt |= update(mesh.second, bvhType, {mesh.first}, rebuildRatio);
+  }
+  for (Instance *instance : instances) {
+    instance->blas = meshBVHs[instance->mesh];
+    instance->updateBounds();
+  }
+  delete bvh;
+  bvh = new TopLevelBVH(worldBVH, instances);
+  return rebuilt;
+}
+
+uint32_t Scene::addMaterial(const Material &material) {
+  materials.push_back(material);
+  return materials.size() - 1;
+}
+
+void Scene::buildEmitters() {
+  emitters.clear();
+  emitterIndex.clear();
+  vector<float> weights;
+  for (Object *object : objects) {
+    for (Primitive *primitive : object->primitives) {
+      if (material(primitive).isLight()) {
+        vec3 emission = material(primitive).emission;
+        emitterIndex[primitive] = emitters.size();
+        emitters.push_back(primitive);
+        weights.push_back(primitive->area() *
+                          dot(emission, vec3(1.f / 3.f)));
+      }
+    }
+  }
+  emitterTable.build(weights);
+}
+
+Primitive *Scene::sampleEmitter(float u, float &pmf) const {
+  if (emitters.empty()) {
+    pmf = 0;
+    return NULL;
+  }
+  return emitters[emitterTable.sample(u, pmf)];
+}
+
+float Scene::emitterPmf(const Primitive *primitive) const {
+  auto found = emitterIndex.find(primitive);
+  return found == emitterIndex.end() ? 0.f : emitterTable.pmf(found->second);
+}
+
+void Scene::LoadTest() {
+  LoadTestModel(objects, materials);
+  buildEmitters();
+}
 
 Texture *loadTexture(string dir, string path) {
   if (path != "") {
@@ -58,6 +270,14 @@ Texture *loadTexture(string dir, string path) {
 
 /* Load Model into scene */
 void Scene::LoadModel(string path) {
+  const string extension = ".scene";
+  if (path.size() > extension.size() &&
+      path.compare(path.size() - extension.size(), extension.size(),
+                   extension) == 0) {
+    LoadSceneFile(path);
+    return;
+  }
+
   attrib_t attrib;
   vector<shape_t> shapes;
   vector<material_t> materials;
@@ -77,6 +297,52 @@ void Scene::LoadModel(string path) {
     exit(1);
   }
 
+  // Each MTL entry is converted into the shared material table once, with
+  // its textures looked up once, and faces refer to it by index
+  vector<uint32_t> materialIds(materials.size());
+  vector<bool> textured(materials.size());
+  for (size_t m = 0; m < materials.size(); m++) {
+    const tinyobj::material_t &material = materials[m];
+
+    textured[m] =
+        material.ambient_texname != "" || material.diffuse_texname != "" ||
+        material.specular_texname != "" ||
+        material.specular_highlight_texname != "" ||
+        material.bump_texname != "" || material.displacement_texname != "" ||
+        material.alpha_texname != "" || material.reflection_texname != "";
+
+    Material mat;
+    mat.color =
+        vec3(material.diffuse[0], material.diffuse[1], material.diffuse[2]);
+    mat.ambient =
+        vec3(material.ambient[0], material.ambient[1], material.ambient[2]);
+    mat.diffuse =
+        vec3(material.diffuse[0], material.diffuse[1], material.diffuse[2]);
+    mat.specular = vec3(material.specular[0], material.specular[1],
+                        material.specular[2]);
+    mat.transmittance =
+        vec3(material.transmittance[0], material.transmittance[1],
+             material.transmittance[2]);
+    mat.emission = vec3(material.emission[0], material.emission[1],
+                        material.emission[2]);
+    mat.shininess = material.shininess;
+    mat.refractiveIndex = material.ior;
+    mat.dissolve = material.dissolve;
+    mat.ambientTexture = loadTexture(dir, material.ambient_texname);
+    mat.diffuseTexture = loadTexture(dir, material.diffuse_texname);
+    mat.specularTexture = loadTexture(dir, material.specular_texname);
+    mat.specularHighlightTexture =
+        loadTexture(dir, material.specular_highlight_texname);
+    mat.bumpTexture = loadTexture(dir, material.bump_texname);
+    mat.displacementTexture = loadTexture(dir, material.displacement_texname);
+    mat.alphaTexture = loadTexture(dir, material.alpha_texname);
+    mat.reflectionTexture = loadTexture(dir, material.reflection_texname);
+    materialIds[m] = addMaterial(mat);
+  }
+  // Faces without a material get a default one, as scene_convert does
+  bool hasDefaultMaterial = false;
+  uint32_t defaultMaterialId = 0;
+
   vector<Primitive *> primitives;
 
   // For each shape?
@@ -87,14 +353,12 @@ void Scene::LoadModel(string path) {
     // For each face
     for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
       // per-face material
-      tinyobj::material_t material = materials[shapes[s].mesh.material_ids[f]];
-
-      bool textured =
-          material.ambient_texname != "" || material.diffuse_texname != "" ||
-          material.specular_texname != "" ||
-          material.specular_highlight_texname != "" ||
-          material.bump_texname != "" || material.displacement_texname != "" ||
-          material.alpha_texname != "" || material.reflection_texname != "";
+      int material = shapes[s].mesh.material_ids[f];
+      bool hasMaterial = material >= 0 && (size_t)material < materials.size();
+      if (!hasMaterial && !hasDefaultMaterial) {
+        defaultMaterialId = addMaterial(Material());
+        hasDefaultMaterial = true;
+      }
 
       int fv = shapes[s].mesh.num_face_vertices[f];
 
@@ -117,7 +381,7 @@ void Scene::LoadModel(string path) {
         real_t green = attrib.colors[3 * idx.vertex_index + 1];
         real_t blue = attrib.colors[3 * idx.vertex_index + 2];
 
-        if (textured) {
+        if (hasMaterial && textured[material]) {
           real_t tx = attrib.texcoords[2 * idx.texcoord_index + 0];
           real_t ty = attrib.texcoords[2 * idx.texcoord_index + 1];
           Vertex vertex = Vertex(vec4(vx, vy, vz, 1), vec4(nx, ny, nz, 0),
@@ -131,36 +395,136 @@ void Scene::LoadModel(string path) {
       }
       index_offset += fv;
 
-      Material mat;
-      mat.color =
-          vec3(material.diffuse[0], material.diffuse[1], material.diffuse[2]);
-      mat.ambient =
-          vec3(material.ambient[0], material.ambient[1], material.ambient[2]);
-      mat.diffuse =
-          vec3(material.diffuse[0], material.diffuse[1], material.diffuse[2]);
-      mat.specular = vec3(material.specular[0], material.specular[1],
-                          material.specular[2]);
-      mat.transmittance =
-          vec3(material.transmittance[0], material.transmittance[1],
-               material.transmittance[2]);
-      mat.emission = vec3(material.emission[0], material.emission[1],
-                          material.emission[2]);
-      mat.shininess = material.shininess;
-      mat.refractiveIndex = material.ior;
-      mat.dissolve = material.dissolve;
-      mat.ambientTexture = loadTexture(dir, material.ambient_texname);
-      mat.diffuseTexture = loadTexture(dir, material.diffuse_texname);
-      mat.specularTexture = loadTexture(dir, material.specular_texname);
-      mat.specularHighlightTexture = loadTexture(dir, material.specular_highlight_texname);
-      mat.bumpTexture = loadTexture(dir, material.bump_texname);
-      mat.displacementTexture = loadTexture(dir, material.displacement_texname);
-      mat.alphaTexture = loadTexture(dir, material.alpha_texname);
-      mat.reflectionTexture = loadTexture(dir, material.reflection_texname);
-
-      primitives.push_back(
-          new Triangle(vertices[0], vertices[2], vertices[1], mat));
+      primitives.push_back(new Triangle(
+          vertices[0], vertices[2], vertices[1],
+          hasMaterial ? materialIds[material] : defaultMaterialId));
     }
 
     objects.push_back(new Object(primitives));
   }
+
+  buildEmitters();
+}
+
+// Whether count elements of size bytes starting at offset lie within the file
+static bool tableFits(uint64_t offset, uint64_t count, uint64_t size,
+                      uint64_t fileSize) {
+  return offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+template <typename T>
+static const T *table(const MappedFile &file, uint64_t offset) {
+  return reinterpret_cast<const T *>(file.data + offset);
+}
+
+static vec3 toVec3(const float *v) { return vec3(v[0], v[1], v[2]); }
+
+void Scene::LoadSceneFile(string path) {
+  MappedFile file(path);
+  SceneFileHeader header;
+  bool valid = file.data != nullptr && file.size >= sizeof(header);
+  if (valid) {
+    memcpy(&header, file.data, sizeof(header));
+    valid = memcmp(header.magic, sceneFileMagic, sizeof(sceneFileMagic)) == 0 &&
+            header.version == sceneFileVersion &&
+            tableFits(header.vertexOffset, header.vertexCount,
+                      sizeof(SceneFileVertex), file.size) &&
+            tableFits(header.triangleOffset, header.triangleCount,
+                      sizeof(SceneFileTriangle), file.size) &&
+            tableFits(header.shapeOffset, header.shapeCount + 1ull,
+                      sizeof(uint32_t), file.size) &&
+            tableFits(header.materialOffset, header.materialCount,
+                      sizeof(SceneFileMaterial), file.size) &&
+            tableFits(header.stringOffset, header.stringBytes, 1, file.size);
+  }
+  if (!valid) {
+    cerr << path << " is not a scene file this version can read" << endl;
+    exit(1);
+  }
+  const SceneFileVertex *vertices =
+      table<SceneFileVertex>(file, header.vertexOffset);
+  const SceneFileTriangle *triangles =
+      table<SceneFileTriangle>(file, header.triangleOffset);
+  const uint32_t *shapeStarts = table<uint32_t>(file, header.shapeOffset);
+  const SceneFileMaterial *fileMaterials =
+      table<SceneFileMaterial>(file, header.materialOffset);
+  const char *strings = table<char>(file, header.stringOffset);
+
+  // Every material goes into the shared table once, with its textures looked
+  // up once, and triangles refer to it by index
+  string dir = path.substr(0, path.find_last_of('/') + 1);
+  vector<uint32_t> materialIds(header.materialCount);
+  vector<bool> textured(header.materialCount, false);
+  for (uint32_t i = 0; i < header.materialCount; i++) {
+    const SceneFileMaterial &from = fileMaterials[i];
+    Material mat;
+    mat.color = toVec3(from.diffuse);
+    mat.ambient = toVec3(from.ambient);
+    mat.diffuse = toVec3(from.diffuse);
+    mat.specular = toVec3(from.specular);
+    mat.transmittance = toVec3(from.transmittance);
+    mat.emission = toVec3(from.emission);
+    mat.shininess = from.shininess;
+    mat.refractiveIndex = from.refractiveIndex;
+    mat.dissolve = from.dissolve;
+    Texture **textures[TEXTURE_COUNT] = {
+        &mat.ambientTexture,      &mat.diffuseTexture,
+        &mat.specularTexture,     &mat.specularHighlightTexture,
+        &mat.bumpTexture,         &mat.displacementTexture,
+        &mat.alphaTexture,        &mat.reflectionTexture};
+    for (int t = 0; t < TEXTURE_COUNT; t++) {
+      uint32_t name = from.textures[t];
+      if (name == sceneFileNoTexture) continue;
+      if (name >= header.stringBytes ||
+          memchr(strings + name, '\0', header.stringBytes - name) == NULL) {
+        cerr << path << " has a texture name outside its strings" << endl;
+        exit(1);
+      }
+      string texture = strings + name;
+      *textures[t] =
+          Texture::createTexture(texture[0] == '/' ? texture : dir + texture);
+      textured[i] = true;
+    }
+    materialIds[i] = addMaterial(mat);
+  }
+
+  triangleBlocks.emplace_back();
+  vector<Triangle> &block = triangleBlocks.back();
+  block.reserve(header.triangleCount);
+  for (uint32_t s = 0; s < header.shapeCount; s++) {
+    uint32_t first = shapeStarts[s], last = shapeStarts[s + 1];
+    if (first > last || last > header.triangleCount) {
+      cerr << path << " has a shape outside its triangles" << endl;
+      exit(1);
+    }
+    vector<Primitive *> primitives;
+    primitives.reserve(last - first);
+    for (uint32_t t = first; t < last; t++) {
+      const SceneFileTriangle &face = triangles[t];
+      if (face.material >= header.materialCount) {
+        cerr << path << " has a triangle without a material" << endl;
+        exit(1);
+      }
+      Vertex corners[3];
+      for (int c = 0; c < 3; c++) {
+        if (face.vertex[c] >= header.vertexCount) {
+          cerr << path << " has a triangle outside its vertices" << endl;
+          exit(1);
+        }
+        const SceneFileVertex &from = vertices[face.vertex[c]];
+        // uvs are only kept for textured materials, as LoadModel does
+        vec2 uv = textured[face.material] ? vec2(from.uv[0], from.uv[1])
+                                          : vec2(0);
+        corners[c] = Vertex(vec4(toVec3(from.position), 1),
+                            vec4(toVec3(from.normal), 0), uv, vec3(0));
+      }
+      // Wound the same way as LoadModel
+      block.emplace_back(corners[0], corners[2], corners[1],
+                         materialIds[face.material]);
+      primitives.push_back(&block.back());
+    }
+    objects.push_back(new Object(primitives));
+  }
+
+  buildEmitters();
 }
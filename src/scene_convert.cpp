@@ -0,0 +1,25 @@
+#include <iostream>
+#include <string>
+
+#include "scene_file.h"
+
+using namespace std;
+
+// Converts an OBJ model to a scene file that loads without any parsing
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    cerr << "Usage: " << argv[0] << " model.obj [model.scene]\n"
+         << "Writes the model and its materials to model.scene next to it,\n"
+         << "or to the given path. Textures are referenced, not copied.\n";
+    return 1;
+  }
+  string input = argv[1];
+  string output = argc > 2 ? argv[2] : input.substr(0, input.rfind('.')) +
+                                           ".scene";
+  string error;
+  if (!ConvertObjToSceneFile(input, output, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,177 @@
+#include "scene_file.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "mapped_file.h"
+#include "tiny_obj_loader.h"
+
+using namespace std;
+using tinyobj::real_t;
+
+static void assign(float *to, const real_t *from, int count) {
+  for (int i = 0; i < count; i++) to[i] = from[i];
+}
+
+// MTL texture names are relative to the OBJ, so they stay as they are when
+// the scene file sits next to it and are made absolute otherwise
+static string texturePath(const string &objDir, const string &sceneDir,
+                          const string &name) {
+  if (objDir == sceneDir || name[0] == '/') return name;
+  string path = objDir + name;
+  char resolved[PATH_MAX];
+  if (realpath(path.c_str(), resolved) != NULL) return resolved;
+  return path;
+}
+
+bool ConvertObjToSceneFile(const string &objPath, const string &scenePath,
+                           string &error) {
+  tinyobj::attrib_t attrib;
+  vector<tinyobj::shape_t> shapes;
+  vector<tinyobj::material_t> materials;
+  string objDir = objPath.substr(0, objPath.find_last_of('/') + 1);
+  string sceneDir = scenePath.substr(0, scenePath.find_last_of('/') + 1);
+  string messages;
+  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &messages,
+                        objPath.c_str(), objDir.c_str())) {
+    error = messages;
+    return false;
+  }
+  if (!messages.empty()) cerr << messages << endl;
+
+  // Faces without a material get a default one added after the MTL's
+  uint32_t defaultMaterial = materials.size();
+  bool usesDefault = false;
+
+  // OBJ corners index positions, normals and uvs separately, while the scene
+  // file has one index per corner, so every distinct combination becomes a
+  // vertex
+  map<tuple<int, int, int>, uint32_t> vertexIndex;
+  vector<SceneFileVertex> vertices;
+  vector<SceneFileTriangle> triangles;
+  vector<uint32_t> shapeStarts;
+  for (const tinyobj::shape_t &shape : shapes) {
+    shapeStarts.push_back(triangles.size());
+    for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
+      if (shape.mesh.num_face_vertices[f] != 3) {
+        error = objPath + ": " + shape.name + " has faces with " +
+                to_string(shape.mesh.num_face_vertices[f]) + " vertices";
+        return false;
+      }
+      SceneFileTriangle triangle;
+      int material = shape.mesh.material_ids[f];
+      if (material < 0 || (uint32_t)material >= materials.size()) {
+        triangle.material = defaultMaterial;
+        usesDefault = true;
+      } else {
+        triangle.material = material;
+      }
+      for (int c = 0; c < 3; c++) {
+        const tinyobj::index_t &corner = shape.mesh.indices[3 * f + c];
+        auto key = make_tuple(corner.vertex_index, corner.normal_index,
+                              corner.texcoord_index);
+        auto found = vertexIndex.find(key);
+        if (found != vertexIndex.end()) {
+          triangle.vertex[c] = found->second;
+          continue;
+        }
+        SceneFileVertex vertex = {};
+        assign(vertex.position, &attrib.vertices[3 * corner.vertex_index], 3);
+        if (corner.normal_index >= 0) {
+          assign(vertex.normal, &attrib.normals[3 * corner.normal_index], 3);
+        }
+        if (corner.texcoord_index >= 0) {
+          assign(vertex.uv, &attrib.texcoords[2 * corner.texcoord_index], 2);
+        }
+        triangle.vertex[c] = vertices.size();
+        vertexIndex[key] = vertices.size();
+        vertices.push_back(vertex);
+      }
+      triangles.push_back(triangle);
+    }
+  }
+  shapeStarts.push_back(triangles.size());
+
+  vector<char> strings;
+  vector<SceneFileMaterial> fileMaterials;
+  for (const tinyobj::material_t &material : materials) {
+    SceneFileMaterial to;
+    assign(to.ambient, material.ambient, 3);
+    assign(to.diffuse, material.diffuse, 3);
+    assign(to.specular, material.specular, 3);
+    assign(to.transmittance, material.transmittance, 3);
+    assign(to.emission, material.emission, 3);
+    to.shininess = material.shininess;
+    to.refractiveIndex = material.ior;
+    to.dissolve = material.dissolve;
+    const string *names[TEXTURE_COUNT] = {
+        &material.ambient_texname,      &material.diffuse_texname,
+        &material.specular_texname,     &material.specular_highlight_texname,
+        &material.bump_texname,         &material.displacement_texname,
+        &material.alpha_texname,        &material.reflection_texname};
+    for (int t = 0; t < TEXTURE_COUNT; t++) {
+      to.textures[t] = sceneFileNoTexture;
+      if (names[t]->empty()) continue;
+      string path = texturePath(objDir, sceneDir, *names[t]);
+      to.textures[t] = strings.size();
+      strings.insert(strings.end(), path.begin(), path.end());
+      strings.push_back('\0');
+    }
+    fileMaterials.push_back(to);
+  }
+  if (usesDefault) {
+    // The same as a default constructed Material
+    SceneFileMaterial to = {};
+    to.shininess = 1;
+    to.refractiveIndex = 1;
+    for (int t = 0; t < TEXTURE_COUNT; t++) to.textures[t] = sceneFileNoTexture;
+    fileMaterials.push_back(to);
+  }
+
+  SceneFileHeader header;
+  memcpy(header.magic, sceneFileMagic, sizeof(sceneFileMagic));
+  header.version = sceneFileVersion;
+  header.vertexCount = vertices.size();
+  header.triangleCount = triangles.size();
+  header.shapeCount = shapes.size();
+  header.materialCount = fileMaterials.size();
+  header.stringBytes = strings.size();
+  header.vertexOffset = alignOffset(sizeof(header), 16);
+  header.triangleOffset = alignOffset(
+      header.vertexOffset + vertices.size() * sizeof(SceneFileVertex), 16);
+  header.shapeOffset = alignOffset(
+      header.triangleOffset + triangles.size() * sizeof(SceneFileTriangle), 16);
+  header.materialOffset = alignOffset(
+      header.shapeOffset + shapeStarts.size() * sizeof(uint32_t), 16);
+  header.stringOffset = alignOffset(
+      header.materialOffset + fileMaterials.size() * sizeof(SceneFileMaterial),
+      16);
+
+  ofstream file(scenePath.c_str(), ios::binary | ios::trunc);
+  if (!file) {
+    error = "Can't write " + scenePath;
+    return false;
+  }
+  writeAt(file, 0, &header, sizeof(header));
+  writeAt(file, header.vertexOffset, vertices.data(),
+          vertices.size() * sizeof(SceneFileVertex));
+  writeAt(file, header.triangleOffset, triangles.data(),
+          triangles.size() * sizeof(SceneFileTriangle));
+  writeAt(file, header.shapeOffset, shapeStarts.data(),
+          shapeStarts.size() * sizeof(uint32_t));
+  writeAt(file, header.materialOffset, fileMaterials.data(),
+          fileMaterials.size() * sizeof(SceneFileMaterial));
+  writeAt(file, header.stringOffset, strings.data(), strings.size());
+  file.close();
+  if (!file) {
+    error = "Can't write " + scenePath;
+    return false;
+  }
+  return true;
+}
@@ -9,6 +9,13 @@ using namespace cv;
 using glm::clamp;
 using glm::vec3;
 
+// Average of everything accumulated into pixel i, or its denoised value
+static vec3 pixelMean(screen* s, int i) {
+  if (s->denoised != NULL) return s->denoised[i];
+  float count = s->accumulate ? s->sampleCounts[i] : 1.f;
+  return s->pixels[i] / (count > 0 ? count : 1.f);
+}
+
 void SDL_SaveImage(screen* s, const char* filename) {
   Mat mat = cvUnpackToMat(s);
   imwrite(filename, mat);
@@ -17,10 +24,18 @@ void SDL_SaveImage(screen* s, const char* filename) {
 void KillSDL(screen* s) {
   delete[] s->pixels;
   delete[] s->depthBuffer;
-  SDL_DestroyTexture(s->texture);
-  SDL_DestroyRenderer(s->renderer);
-  SDL_DestroyWindow(s->window);
-  SDL_Quit();
+  delete[] s->albedo;
+  delete[] s->normals;
+  delete[] s->denoised;
+  delete[] s->sampleCounts;
+  delete[] s->pixelSquares;
+  // Headless screens never opened a window
+  if (s->window != NULL) {
+    SDL_DestroyTexture(s->texture);
+    SDL_DestroyRenderer(s->renderer);
+    SDL_DestroyWindow(s->window);
+    SDL_Quit();
+  }
 }
 
 void SDL_Renderframe(screen* s) {
@@ -28,8 +43,7 @@ void SDL_Renderframe(screen* s) {
 #pragma omp parallel for collapse(2)
   for (int y = 0; y < s->height; y++) {
     for (int x = 0; x < s->width; x++) {
-      glm::vec3 color = s->pixels[y * s->width + x] /
-                        (float)(s->samples > 0 ? s->samples : 1.f);
+      glm::vec3 color = pixelMean(s, y * s->width + x);
       uint32_t r = uint32_t(clamp(255 * color.r, 0.f, 255.f));
       uint32_t g = uint32_t(clamp(255 * color.g, 0.f, 255.f));
       uint32_t b = uint32_t(clamp(255 * color.b, 0.f, 255.f));
@@ -45,6 +59,9 @@ void SDL_Renderframe(screen* s) {
 
 screen* createScreen(string type, int width, int height) {
   screen* s = new screen;
+  s->window = NULL;
+  s->renderer = NULL;
+  s->texture = NULL;
   s->width = width;
   s->height = height;
   if (type == "raytracer") {
@@ -54,6 +71,11 @@ screen* createScreen(string type, int width, int height) {
   }
   s->pixels = new vec3[width * height];
   s->depthBuffer = new float[width * height];
+  s->albedo = new vec3[width * height];
+  s->normals = new vec3[width * height];
+  s->denoised = NULL;
+  s->sampleCounts = new uint32_t[width * height];
+  s->pixelSquares = new vec3[width * height];
   s->samples = 0;
 
   clear(s);
@@ -115,10 +137,34 @@ bool NoQuitMessageSDL() {
 }
 
 void RaytracerPutPixelSDL(screen* s, int x, int y, vec3 color, float samples) {
-  s->pixels[y * s->width + x] += color;
+  int i = y * s->width + x;
+  s->pixels[i] += color;
+  s->sampleCounts[i]++;
+  s->pixelSquares[i] += color * color;
   s->samples = samples;
 }
 
+float PixelError(screen* s, int x, int y) {
+  int i = y * s->width + x;
+  float n = s->sampleCounts[i];
+  if (n < 2) return INFINITY;
+  vec3 mean = s->pixels[i] / n;
+  vec3 variance =
+      glm::max(s->pixelSquares[i] / n - mean * mean, vec3(0)) * n / (n - 1);
+  vec3 error = glm::sqrt(variance / n);
+  // A channel sure to stay above 1 is displayed as 1 whatever its noise
+  error *= vec3(glm::lessThanEqual(mean - 2.f * error, vec3(1)));
+  return max(error.r, max(error.g, error.b));
+}
+
+void PutFeaturesSDL(screen* s, int x, int y, vec3 albedo, vec3 normal,
+                    float depth) {
+  int i = y * s->width + x;
+  s->albedo[i] = albedo;
+  s->normals[i] = normal;
+  s->depthBuffer[i] = depth;
+}
+
 void RasteriserPutPixelSDL(screen* s, int x, int y, vec3 color, float depth) {
   if (depth > s->depthBuffer[y * s->width + x]) {
     s->depthBuffer[y * s->width + x] = depth;
@@ -143,8 +189,7 @@ Mat cvUnpackToMat(screen* s) {
 #pragma omp parallel for collapse(2)
   for (uint32_t y = 0; y < s->height; ++y) {
     for (uint32_t x = 0; x < s->width; ++x) {
-      vec3 pixel = s->pixels[y * s->width + x] /
-                        (float)(s->samples > 0 ? s->samples : 1.f);
+      vec3 pixel = pixelMean(s, y * s->width + x);
 
       Vec3b color = mat.at<Vec3b>(Point(x, y));
       color[0] = clamp(pixel.b * 255.f, 0.f, 255.f);
@@ -166,7 +211,9 @@ void cvPackToScreen(screen* s, Mat mat) {
       float g = clamp((float)color[1] / 255.f, 0.f, 1.f);
       float b = clamp((float)color[0] / 255.f, 0.f, 1.f);
 
-      s->pixels[y * s->width + x] = vec3(r, g, b);
+      // Raytraced pixels hold a sum, keep the same mean once re-read
+      int i = y * s->width + x;
+      s->pixels[i] = vec3(r, g, b) * (s->accumulate ? s->sampleCounts[i] : 1.f);
     }
   }
 }
@@ -175,4 +222,8 @@ void clear(screen* s) {
   memset(s->pixels, 0, s->height * s->width * sizeof(vec3));
   memset(s->depthBuffer, 0.f,
          s->height * s->width * sizeof(float));
+  memset(s->sampleCounts, 0, s->height * s->width * sizeof(uint32_t));
+  memset(s->pixelSquares, 0, s->height * s->width * sizeof(vec3));
+  memset(s->albedo, 0, s->height * s->width * sizeof(vec3));
+  memset(s->normals, 0, s->height * s->width * sizeof(vec3));
 }
@@ -0,0 +1,84 @@
+#include "stats.h"
+
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static const char *counterNames[STAT_COUNT] = {
+    "nodes_visited",   "primitives_tested", "camera_rays",
+    "shadow_rays",     "diffuse_rays",      "specular_rays",
+    "refraction_rays", "paths",             "path_vertices",
+    "roulette_terminations",
+};
+
+// Every live thread's counters, the counts of threads that have exited, and
+// the totals at the last collection
+static mutex registryLock;
+static vector<ThreadStats *> registry;
+static uint64_t retired[STAT_COUNT];
+static uint64_t collected[STAT_COUNT];
+
+#ifdef RENDER_STATS
+thread_local ThreadStats threadStats;
+#endif
+
+ThreadStats::ThreadStats() {
+  memset(counters, 0, sizeof(counters));
+  lock_guard<mutex> guard(registryLock);
+  registry.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+  lock_guard<mutex> guard(registryLock);
+  for (uint32_t i = 0; i < STAT_COUNT; i++) retired[i] += counters[i];
+  registry.erase(find(registry.begin(), registry.end(), this));
+}
+
+FrameStats CollectFrameStats(double seconds) {
+  FrameStats frame;
+  frame.seconds = seconds;
+  lock_guard<mutex> guard(registryLock);
+  for (uint32_t i = 0; i < STAT_COUNT; i++) {
+    uint64_t total = retired[i];
+    for (const ThreadStats *thread : registry) total += thread->counters[i];
+    frame.counters[i] = total - collected[i];
+    collected[i] = total;
+  }
+  return frame;
+}
+
+void FrameStats::print(ostream &out) const {
+  out << "Render time: " << seconds * 1000 << " ms.";
+#ifdef RENDER_STATS
+  uint64_t rays = 0;
+  for (uint32_t i = STAT_CAMERA_RAYS; i <= STAT_REFRACTION_RAYS; i++) {
+    rays += counters[i];
+  }
+  uint64_t paths = max(counters[STAT_PATHS], (uint64_t)1);
+  out << " Rays: " << counters[STAT_CAMERA_RAYS] << " camera, "
+      << counters[STAT_SHADOW_RAYS] << " shadow, "
+      << counters[STAT_DIFFUSE_RAYS] << " diffuse, "
+      << counters[STAT_SPECULAR_RAYS] << " specular, "
+      << counters[STAT_REFRACTION_RAYS] << " refraction ("
+      << rays / max(seconds, 1e-9) / 1e6 << " M/s). Per ray: "
+      << (float)counters[STAT_NODES_VISITED] / max(rays, (uint64_t)1)
+      << " nodes, "
+      << (float)counters[STAT_PRIMITIVES_TESTED] / max(rays, (uint64_t)1)
+      << " primitives. Paths: "
+      << (float)counters[STAT_PATH_VERTICES] / paths << " hits on average, "
+      << 100.f * counters[STAT_ROULETTE_TERMINATIONS] / paths
+      << "% ended by roulette.";
+#endif
+  out << endl;
+}
+
+void FrameStats::writeJson(ostream &out) const {
+  out << "{\"seconds\": " << seconds;
+  for (uint32_t i = 0; i < STAT_COUNT; i++) {
+    out << ", \"" << counterNames[i] << "\": " << counters[i];
+  }
+  out << "}" << endl;
+}
@@ -0,0 +1,136 @@
+#include "tile_scheduler.h"
+
+#include <omp.h>
+#include <algorithm>
+
+using namespace std;
+
+// Position along a Morton curve: the bits of x and y interleaved
+static uint32_t mortonIndex(uint32_t x, uint32_t y) {
+  uint32_t index = 0;
+  for (uint32_t bit = 0; bit < 16; bit++) {
+    index |= ((x >> bit) & 1) << (2 * bit);
+    index |= ((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return index;
+}
+
+// Position along a Hilbert curve filling an n by n grid, n a power of two
+static uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+  uint32_t index = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    index += s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the curve inside it starts where it enters
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      swap(x, y);
+    }
+  }
+  return index;
+}
+
+TileScheduler::TileScheduler(int width, int height, int tileSize,
+                             TileOrder order) {
+  uint32_t tilesX = (width + tileSize - 1) / tileSize;
+  uint32_t tilesY = (height + tileSize - 1) / tileSize;
+  uint32_t n = 1;
+  while (n < max(tilesX, tilesY)) n *= 2;
+
+  vector<pair<uint32_t, Tile>> ordered;
+  for (uint32_t y = 0; y < tilesY; y++) {
+    for (uint32_t x = 0; x < tilesX; x++) {
+      Tile tile;
+      tile.x = x * tileSize;
+      tile.y = y * tileSize;
+      tile.width = min(tileSize, width - tile.x);
+      tile.height = min(tileSize, height - tile.y);
+      uint32_t index = y * tilesX + x;
+      if (order == TILE_ORDER_MORTON) index = mortonIndex(x, y);
+      if (order == TILE_ORDER_HILBERT) index = hilbertIndex(n, x, y);
+      ordered.push_back(make_pair(index, tile));
+    }
+  }
+  sort(ordered.begin(), ordered.end(),
+       [](const pair<uint32_t, Tile> &a, const pair<uint32_t, Tile> &b) {
+         return a.first < b.first;
+       });
+  for (const pair<uint32_t, Tile> &entry : ordered) {
+    tiles.push_back(entry.second);
+  }
+  tileTimes.assign(tiles.size(), 0);
+}
+
+void TileScheduler::run(const function<void(const Tile &)> &render) {
+  uint32_t threadCount = omp_get_max_threads();
+  if (queues.size() != threadCount) {
+    vector<WorkQueue, AlignedAllocator<WorkQueue>>(threadCount).swap(queues);
+  }
+  for (uint32_t i = 0; i < threadCount; i++) {
+    uint32_t first = tiles.size() * i / threadCount;
+    uint32_t last = tiles.size() * (i + 1) / threadCount;
+    queues[i].tiles.clear();
+    for (uint32_t tile = first; tile < last; tile++) {
+      queues[i].tiles.push_back(tile);
+    }
+    queues[i].busyTime = 0;
+    queues[i].steals = 0;
+  }
+
+  double start = omp_get_wtime();
+#pragma omp parallel num_threads(threadCount)
+  {
+    uint32_t thread = omp_get_thread_num();
+    uint32_t tile;
+    while (pop(thread, tile) || steal(thread, tile)) {
+      double tileStart = omp_get_wtime();
+      render(tiles[tile]);
+      tileTimes[tile] = omp_get_wtime() - tileStart;
+      queues[thread].busyTime += tileTimes[tile];
+    }
+  }
+  frameTime = omp_get_wtime() - start;
+}
+
+bool TileScheduler::pop(uint32_t thread, uint32_t &tile) {
+  WorkQueue &queue = queues[thread];
+  lock_guard<mutex> guard(queue.lock);
+  if (queue.tiles.empty()) return false;
+  tile = queue.tiles.front();
+  queue.tiles.pop_front();
+  return true;
+}
+
+bool TileScheduler::steal(uint32_t thread, uint32_t &tile) {
+  for (uint32_t i = 1; i < queues.size(); i++) {
+    WorkQueue &victim = queues[(thread + i) % queues.size()];
+    lock_guard<mutex> guard(victim.lock);
+    if (victim.tiles.empty()) continue;
+    tile = victim.tiles.back();
+    victim.tiles.pop_back();
+    queues[thread].steals++;
+    return true;
+  }
+  return false;
+}
+
+void TileScheduler::printStats(ostream &out) const {
+  double slowest = 0, total = 0, busy = 0;
+  uint32_t steals = 0;
+  for (double time : tileTimes) {
+    slowest = max(slowest, time);
+    total += time;
+  }
+  for (const WorkQueue &queue : queues) {
+    busy += queue.busyTime;
+    steals += queue.steals;
+  }
+  out << "Tiles: " << tiles.size() << ", slowest " << slowest * 1000
+      << " ms, mean " << total * 1000 / tiles.size() << " ms, " << steals
+      << " stolen, " << (int)(100 * busy / (frameTime * queues.size()))
+      << "% busy." << endl;
+}
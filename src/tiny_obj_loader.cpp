@@ -1,4 +1,5 @@
 #include "tiny_obj_loader.h"
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cmath>
@@ -6,10 +7,13 @@
 #include <cstdlib>
 #include <cstring>
 #include <utility>
+#include <omp.h>
 
 #include <fstream>
 #include <sstream>
 
+#include "mapped_file.h"
+
 namespace tinyobj {
 
 MaterialReader::~MaterialReader() {}
@@ -111,6 +115,27 @@ static inline bool fixIndex(int idx, int n, int *ret) {
   return false;  // never reach here.
 }
 
+// Inline stand-ins for strspn(s, " \t"), strcspn(s, " \t\r") with an optional
+// extra stop character, and atoi, which run for every number in a file.
+static inline const char *skipSpace(const char *s) {
+  while (IS_SPACE(*s)) s++;
+  return s;
+}
+
+static inline const char *skipToken(const char *s, char stop = ' ') {
+  while (*s != '\0' && !IS_SPACE(*s) && *s != '\r' && *s != stop) s++;
+  return s;
+}
+
+static inline int parseIndex(const char *s) {
+  s = skipSpace(s);
+  bool negative = *s == '-';
+  if (*s == '+' || *s == '-') s++;
+  int i = 0;
+  while (IS_DIGIT(*s)) i = i * 10 + (*s++ - '0');
+  return negative ? -i : i;
+}
+
 static inline std::string parseString(const char **token) {
   std::string s;
   (*token) += strspn((*token), " \t");
@@ -154,124 +179,109 @@ static inline int parseInt(const char **token) {
 //  - s >= s_end.
 //  - parse failure.
 //
+// The digits are gathered into an integer, which is exact for up to 19 of
+// them, and scaled by a single power of ten at the end. Digits past the 19th
+// only move the exponent.
 static bool tryParseDouble(const char *s, const char *s_end, double *result) {
+  static const double pow10_lut[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+  const int lut_entries = sizeof pow10_lut / sizeof pow10_lut[0];
+  const int max_digits = 19;
+
   if (s >= s_end) {
     return false;
   }
 
-  double mantissa = 0.0;
-  // This exponent is base 2 rather than 10.
-  // However the exponent we parse is supposed to be one of ten,
-  // thus we must take care to convert the exponent/and or the
-  // mantissa to a * 2^E, where a is the mantissa and E is the
-  // exponent.
-  // To get the final double we will use ldexp, it requires the
-  // exponent to be in base 2.
+  const char *curr = s;
+  bool negative = false;
+  unsigned long long mantissa = 0;
+  // Significant digits in mantissa, and the power of ten it is scaled by.
+  int digits = 0;
   int exponent = 0;
-
-  // NOTE: THESE MUST BE DECLARED HERE SINCE WE ARE NOT ALLOWED
-  // TO JUMP OVER DEFINITIONS.
-  char sign = '+';
-  char exp_sign = '+';
-  char const *curr = s;
-
   // How many characters were read in a loop.
   int read = 0;
-  // Tells whether a loop terminated due to reaching s_end.
-  bool end_not_reached = false;
-
-  /*
-          BEGIN PARSING.
-  */
 
   // Find out what sign we've got.
   if (*curr == '+' || *curr == '-') {
-    sign = *curr;
+    negative = *curr == '-';
     curr++;
-  } else if (IS_DIGIT(*curr)) { /* Pass through. */
-  } else {
-    goto fail;
   }
 
   // Read the integer part.
-  end_not_reached = (curr != s_end);
-  while (end_not_reached && IS_DIGIT(*curr)) {
-    mantissa *= 10;
-    mantissa += static_cast<int>(*curr - 0x30);
+  while (curr != s_end && IS_DIGIT(*curr)) {
+    if (digits < max_digits) {
+      mantissa = mantissa * 10 + static_cast<unsigned int>(*curr - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
     curr++;
     read++;
-    end_not_reached = (curr != s_end);
   }
 
   // We must make sure we actually got something.
-  if (read == 0) goto fail;
-  // We allow numbers of form "#", "###" etc.
-  if (!end_not_reached) goto assemble;
+  if (read == 0) {
+    return false;
+  }
 
   // Read the decimal part.
-  if (*curr == '.') {
+  if (curr != s_end && *curr == '.') {
     curr++;
-    read = 1;
-    end_not_reached = (curr != s_end);
-    while (end_not_reached && IS_DIGIT(*curr)) {
-      static const double pow_lut[] = {
-          1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001,
-      };
-      const int lut_entries = sizeof pow_lut / sizeof pow_lut[0];
-
-      // NOTE: Don't use powf here, it will absolutely murder precision.
-      mantissa += static_cast<int>(*curr - 0x30) *
-                  (read < lut_entries ? pow_lut[read] : std::pow(10.0, -read));
-      read++;
+    while (curr != s_end && IS_DIGIT(*curr)) {
+      if (digits < max_digits) {
+        mantissa = mantissa * 10 + static_cast<unsigned int>(*curr - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
       curr++;
-      end_not_reached = (curr != s_end);
     }
-  } else if (*curr == 'e' || *curr == 'E') {
-  } else {
-    goto assemble;
   }
 
-  if (!end_not_reached) goto assemble;
-
   // Read the exponent part.
-  if (*curr == 'e' || *curr == 'E') {
+  if (curr != s_end && (*curr == 'e' || *curr == 'E')) {
     curr++;
-    // Figure out if a sign is present and if it is.
-    end_not_reached = (curr != s_end);
-    if (end_not_reached && (*curr == '+' || *curr == '-')) {
-      exp_sign = *curr;
+    bool exp_negative = false;
+    if (curr != s_end && (*curr == '+' || *curr == '-')) {
+      exp_negative = *curr == '-';
       curr++;
-    } else if (IS_DIGIT(*curr)) { /* Pass through. */
-    } else {
-      // Empty E is not allowed.
-      goto fail;
     }
 
+    int exp_value = 0;
     read = 0;
-    end_not_reached = (curr != s_end);
-    while (end_not_reached && IS_DIGIT(*curr)) {
-      exponent *= 10;
-      exponent += static_cast<int>(*curr - 0x30);
+    while (curr != s_end && IS_DIGIT(*curr)) {
+      // Anything this large is already out of range for a double.
+      if (exp_value < 100000) {
+        exp_value = exp_value * 10 + (*curr - '0');
+      }
       curr++;
       read++;
-      end_not_reached = (curr != s_end);
     }
-    exponent *= (exp_sign == '+' ? 1 : -1);
-    if (read == 0) goto fail;
+    // Empty E is not allowed.
+    if (read == 0) {
+      return false;
+    }
+    exponent += exp_negative ? -exp_value : exp_value;
   }
 
-assemble:
-  *result = (sign == '+' ? 1 : -1) *
-            (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent)
-                      : mantissa);
+  double value = static_cast<double>(mantissa);
+  if (mantissa == 0) {
+  } else if (exponent < 0 && -exponent < lut_entries) {
+    // Dividing by an exact power of ten rounds only once.
+    value /= pow10_lut[-exponent];
+  } else if (exponent >= 0 && exponent < lut_entries) {
+    value *= pow10_lut[exponent];
+  } else {
+    value *= std::pow(10.0, exponent);
+  }
+  *result = negative ? -value : value;
   return true;
-fail:
-  return false;
 }
 
 static inline real_t parseReal(const char **token, double default_value = 0.0) {
-  (*token) += strspn((*token), " \t");
-  const char *end = (*token) + strcspn((*token), " \t\r");
+  (*token) = skipSpace(*token);
+  const char *end = skipToken(*token);
   double val = default_value;
   tryParseDouble((*token), end, &val);
   real_t f = static_cast<real_t>(val);
@@ -280,8 +290,8 @@ static inline real_t parseReal(const char **token, double default_value = 0.0) {
 }
 
 static inline bool parseReal(const char **token, real_t *out) {
-  (*token) += strspn((*token), " \t");
-  const char *end = (*token) + strcspn((*token), " \t\r");
+  (*token) = skipSpace(*token);
+  const char *end = skipToken(*token);
   double val;
   bool ret = tryParseDouble((*token), end, &val);
   if (ret) {
@@ -412,11 +422,11 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 
   vertex_index_t vi(-1);
 
-  if (!fixIndex(atoi((*token)), vsize, &(vi.v_idx))) {
+  if (!fixIndex(parseIndex(*token), vsize, &(vi.v_idx))) {
     return false;
   }
 
-  (*token) += strcspn((*token), "/ \t\r");
+  (*token) = skipToken(*token, '/');
   if ((*token)[0] != '/') {
     (*ret) = vi;
     return true;
@@ -426,20 +436,20 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
   // i//k
   if ((*token)[0] == '/') {
     (*token)++;
-    if (!fixIndex(atoi((*token)), vnsize, &(vi.vn_idx))) {
+    if (!fixIndex(parseIndex(*token), vnsize, &(vi.vn_idx))) {
       return false;
     }
-    (*token) += strcspn((*token), "/ \t\r");
+    (*token) = skipToken(*token, '/');
     (*ret) = vi;
     return true;
   }
 
   // i/j/k or i/j
-  if (!fixIndex(atoi((*token)), vtsize, &(vi.vt_idx))) {
+  if (!fixIndex(parseIndex(*token), vtsize, &(vi.vt_idx))) {
     return false;
   }
 
-  (*token) += strcspn((*token), "/ \t\r");
+  (*token) = skipToken(*token, '/');
   if ((*token)[0] != '/') {
     (*ret) = vi;
     return true;
@@ -447,10 +457,10 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 
   // i/j/k
   (*token)++;  // skip '/'
-  if (!fixIndex(atoi((*token)), vnsize, &(vi.vn_idx))) {
+  if (!fixIndex(parseIndex(*token), vnsize, &(vi.vn_idx))) {
     return false;
   }
-  (*token) += strcspn((*token), "/ \t\r");
+  (*token) = skipToken(*token, '/');
 
   (*ret) = vi;
 
@@ -461,8 +471,8 @@ static bool parseTriple(const char **token, int vsize, int vnsize, int vtsize,
 static vertex_index_t parseRawTriple(const char **token) {
   vertex_index_t vi(static_cast<int>(0));  // 0 is an invalid index in OBJ
 
-  vi.v_idx = atoi((*token));
-  (*token) += strcspn((*token), "/ \t\r");
+  vi.v_idx = parseIndex(*token);
+  (*token) = skipToken(*token, '/');
   if ((*token)[0] != '/') {
     return vi;
   }
@@ -471,22 +481,22 @@ static vertex_index_t parseRawTriple(const char **token) {
   // i//k
   if ((*token)[0] == '/') {
     (*token)++;
-    vi.vn_idx = atoi((*token));
-    (*token) += strcspn((*token), "/ \t\r");
+    vi.vn_idx = parseIndex(*token);
+    (*token) = skipToken(*token, '/');
     return vi;
   }
 
   // i/j/k or i/j
-  vi.vt_idx = atoi((*token));
-  (*token) += strcspn((*token), "/ \t\r");
+  vi.vt_idx = parseIndex(*token);
+  (*token) = skipToken(*token, '/');
   if ((*token)[0] != '/') {
     return vi;
   }
 
   // i/j/k
   (*token)++;  // skip '/'
-  vi.vn_idx = atoi((*token));
-  (*token) += strcspn((*token), "/ \t\r");
+  vi.vn_idx = parseIndex(*token);
+  (*token) = skipToken(*token, '/');
   return vi;
 }
 
@@ -1307,6 +1317,387 @@ bool MaterialStreamReader::operator()(const std::string &matId,
   return true;
 }
 
+// What the statements between faces have set up so far: the shape being
+// filled, the faces waiting to be exported into it and what they share.
+struct obj_state {
+  std::vector<tag_t> tags;
+  std::vector<face_t> faceGroup;
+  std::string name;
+
+  // material
+  std::map<std::string, int> material_map;
+  int material;
+
+  // smoothing group id
+  unsigned int current_smoothing_id;  // 0 means no smoothing.
+
+  shape_t shape;
+
+  obj_state() : material(-1), current_smoothing_id(0) {}
+};
+
+// Handles a line that is neither a vertex attribute nor a face. `token` must
+// be null terminated where the line ends, without the '\r' of a '\r\n'.
+static void parseStatement(const char *token, obj_state *state,
+                           std::vector<shape_t> *shapes,
+                           std::vector<material_t> *materials,
+                           MaterialReader *readMatFn, bool triangulate,
+                           const std::vector<real_t> &v, std::string *err) {
+  // use mtl
+  if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
+    token += 7;
+    std::stringstream ss;
+    ss << token;
+    std::string namebuf = ss.str();
+
+    int newMaterialId = -1;
+    if (state->material_map.find(namebuf) != state->material_map.end()) {
+      newMaterialId = state->material_map[namebuf];
+    } else {
+      // { error!! material not found }
+    }
+
+    if (newMaterialId != state->material) {
+      // Create per-face material. Thus we don't add `shape` to `shapes` at
+      // this time.
+      // just clear `faceGroup` after `exportFaceGroupToShape()` call.
+      exportFaceGroupToShape(&state->shape, state->faceGroup, state->tags,
+                             state->material, state->name, triangulate, v);
+      state->faceGroup.clear();
+      state->material = newMaterialId;
+    }
+
+    return;
+  }
+
+  // load mtl
+  if ((0 == strncmp(token, "mtllib", 6)) && IS_SPACE((token[6]))) {
+    if (readMatFn) {
+      token += 7;
+
+      std::vector<std::string> filenames;
+      SplitString(std::string(token), ' ', filenames);
+
+      if (filenames.empty()) {
+        if (err) {
+          (*err) +=
+              "WARN: Looks like empty filename for mtllib. Use default "
+              "material. \n";
+        }
+      } else {
+        bool found = false;
+        for (size_t s = 0; s < filenames.size(); s++) {
+          std::string err_mtl;
+          bool ok = (*readMatFn)(filenames[s].c_str(), materials,
+                                 &state->material_map, &err_mtl);
+          if (err && (!err_mtl.empty())) {
+            (*err) += err_mtl;  // This should be warn message.
+          }
+
+          if (ok) {
+            found = true;
+            break;
+          }
+        }
+
+        if (!found) {
+          if (err) {
+            (*err) +=
+                "WARN: Failed to load material file(s). Use default "
+                "material.\n";
+          }
+        }
+      }
+    }
+
+    return;
+  }
+
+  // group name
+  if (token[0] == 'g' && IS_SPACE((token[1]))) {
+    // flush previous face group.
+    bool ret = exportFaceGroupToShape(&state->shape, state->faceGroup,
+                                      state->tags, state->material,
+                                      state->name, triangulate, v);
+    (void)ret;  // return value not used.
+
+    if (state->shape.mesh.indices.size() > 0) {
+      shapes->push_back(state->shape);
+    }
+
+    state->shape = shape_t();
+
+    // material = -1;
+    state->faceGroup.clear();
+
+    std::vector<std::string> names;
+    names.reserve(2);
+
+    while (!IS_NEW_LINE(token[0])) {
+      std::string str = parseString(&token);
+      names.push_back(str);
+      token += strspn(token, " \t\r");  // skip tag
+    }
+
+    assert(names.size() > 0);
+
+    // names[0] must be 'g', so skip the 0th element.
+    if (names.size() > 1) {
+      state->name = names[1];
+    } else {
+      state->name = "";
+    }
+
+    return;
+  }
+
+  // object name
+  if (token[0] == 'o' && IS_SPACE((token[1]))) {
+    // flush previous face group.
+    bool ret = exportFaceGroupToShape(&state->shape, state->faceGroup,
+                                      state->tags, state->material,
+                                      state->name, triangulate, v);
+    if (ret) {
+      shapes->push_back(state->shape);
+    }
+
+    // material = -1;
+    state->faceGroup.clear();
+    state->shape = shape_t();
+
+    // @todo { multiple object name? }
+    token += 2;
+    std::stringstream ss;
+    ss << token;
+    state->name = ss.str();
+
+    return;
+  }
+
+  if (token[0] == 't' && IS_SPACE(token[1])) {
+    tag_t tag;
+
+    token += 2;
+
+    tag.name = parseString(&token);
+
+    tag_sizes ts = parseTagTriple(&token);
+
+    tag.intValues.resize(static_cast<size_t>(ts.num_ints));
+
+    for (size_t i = 0; i < static_cast<size_t>(ts.num_ints); ++i) {
+      tag.intValues[i] = parseInt(&token);
+    }
+
+    tag.floatValues.resize(static_cast<size_t>(ts.num_reals));
+    for (size_t i = 0; i < static_cast<size_t>(ts.num_reals); ++i) {
+      tag.floatValues[i] = parseReal(&token);
+    }
+
+    tag.stringValues.resize(static_cast<size_t>(ts.num_strings));
+    for (size_t i = 0; i < static_cast<size_t>(ts.num_strings); ++i) {
+      tag.stringValues[i] = parseString(&token);
+    }
+
+    state->tags.push_back(tag);
+
+    return;
+  }
+
+  if (token[0] == 's' && IS_SPACE(token[1])) {
+    // smoothing group id
+    token += 2;
+
+    // skip space.
+    token += strspn(token, " \t");  // skip space
+
+    if (token[0] == '\0') {
+      return;
+    }
+
+    if (token[0] == '\r' || token[1] == '\n') {
+      return;
+    }
+
+    if (strlen(token) >= 3) {
+      if (token[0] == 'o' && token[1] == 'f' && token[2] == 'f') {
+        state->current_smoothing_id = 0;
+      }
+    } else {
+      // assume number
+      int smGroupId = parseInt(&token);
+      if (smGroupId < 0) {
+        // parse error. force set to 0.
+        // FIXME(syoyo): Report warning.
+        state->current_smoothing_id = 0;
+      } else {
+        state->current_smoothing_id = static_cast<unsigned int>(smGroupId);
+      }
+    }
+
+    return;
+  }  // smoothing group id
+
+  // Ignore unknown command.
+}
+
+// Exports the faces read since the last statement that did.
+static void finishShapes(obj_state *state, std::vector<shape_t> *shapes,
+                         bool triangulate, const std::vector<real_t> &v) {
+  bool ret = exportFaceGroupToShape(&state->shape, state->faceGroup,
+                                    state->tags, state->material, state->name,
+                                    triangulate, v);
+  // exportFaceGroupToShape return false when `usemtl` is called in the last
+  // line.
+  // we also add `shape` to `shapes` when `shape.mesh` has already some
+  // faces(indices)
+  if (ret || state->shape.mesh.indices.size()) {
+    shapes->push_back(state->shape);
+  }
+  state->faceGroup.clear();  // for safety
+}
+
+// How many of each vertex attribute a chunk had read when it reached a face
+struct attrib_counts {
+  int v, vn, vt;
+};
+
+// A piece of a mapped .obj cut at line breaks and parsed on its own thread.
+// Faces keep the indices written in the file until the attribute counts of
+// the chunks before this one are known.
+struct obj_chunk {
+  std::vector<real_t> v;
+  std::vector<real_t> vn;
+  std::vector<real_t> vt;
+  std::vector<real_t> vc;
+  std::vector<face_t> faces;
+  std::vector<attrib_counts> faceCounts;
+  // Every other line, after the number of faces in the chunk before it.
+  std::vector<std::pair<size_t, const char *> > statements;
+  // The file's last line if no line break ends it.
+  std::string lastLine;
+  bool failed;
+
+  obj_chunk() : failed(false) {}
+};
+
+// Chunks smaller than this cost more to merge than they save.
+static const size_t min_chunk_size = 1 << 16;
+
+// Terminates each line of [begin, end) in place, then parses the vertex
+// attributes and faces and keeps the rest for parseStatement.
+static void parseChunk(char *begin, char *end, obj_chunk *chunk) {
+  char *line = begin;
+  while (line < end) {
+    char *newline = static_cast<char *>(memchr(line, '\n', end - line));
+    char *line_end = newline ? newline : end;
+    // '\r\n' and a lone '\r' both end a line, as in safeGetline.
+    char *cr = static_cast<char *>(memchr(line, '\r', line_end - line));
+    const char *token = line;
+    if (cr) {
+      *cr = '\0';
+      line = cr + 1 == newline ? newline + 1 : cr + 1;
+    } else if (newline) {
+      *newline = '\0';
+      line = newline + 1;
+    } else {
+      chunk->lastLine.assign(line, end);
+      token = chunk->lastLine.c_str();
+      line = end;
+    }
+
+    // Skip leading space.
+    token = skipSpace(token);
+
+    if (token[0] == '\0') continue;  // empty line
+
+    if (token[0] == '#') continue;  // comment line
+
+    // vertex
+    if (token[0] == 'v' && IS_SPACE((token[1]))) {
+      token += 2;
+      real_t x, y, z;
+      real_t r, g, b;
+      parseVertexWithColor(&x, &y, &z, &r, &g, &b, &token);
+      chunk->v.push_back(x);
+      chunk->v.push_back(y);
+      chunk->v.push_back(z);
+
+      chunk->vc.push_back(r);
+      chunk->vc.push_back(g);
+      chunk->vc.push_back(b);
+      continue;
+    }
+
+    // normal
+    if (token[0] == 'v' && token[1] == 'n' && IS_SPACE((token[2]))) {
+      token += 3;
+      real_t x, y, z;
+      parseReal3(&x, &y, &z, &token);
+      chunk->vn.push_back(x);
+      chunk->vn.push_back(y);
+      chunk->vn.push_back(z);
+      continue;
+    }
+
+    // texcoord
+    if (token[0] == 'v' && token[1] == 't' && IS_SPACE((token[2]))) {
+      token += 3;
+      real_t x, y;
+      parseReal2(&x, &y, &token);
+      chunk->vt.push_back(x);
+      chunk->vt.push_back(y);
+      continue;
+    }
+
+    // face
+    if (token[0] == 'f' && IS_SPACE((token[1]))) {
+      token = skipSpace(token + 2);
+
+      chunk->faces.push_back(face_t());
+      face_t &face = chunk->faces.back();
+      face.vertex_indices.reserve(3);
+
+      while (!IS_NEW_LINE(token[0])) {
+        face.vertex_indices.push_back(parseRawTriple(&token));
+        token = skipSpace(token);
+      }
+
+      attrib_counts counts;
+      counts.v = static_cast<int>(chunk->v.size() / 3);
+      counts.vn = static_cast<int>(chunk->vn.size() / 3);
+      counts.vt = static_cast<int>(chunk->vt.size() / 2);
+      chunk->faceCounts.push_back(counts);
+      continue;
+    }
+
+    chunk->statements.push_back(std::make_pair(chunk->faces.size(), token));
+  }
+}
+
+// Turns the raw indices of a chunk's faces into indices into the merged
+// attributes, given the attribute counts of every chunk before it. A zero
+// texcoord or normal index reads as missing rather than failing the load.
+static void fixChunkIndices(obj_chunk *chunk, const attrib_counts &offset) {
+  for (size_t i = 0; i < chunk->faces.size(); i++) {
+    const attrib_counts &counts = chunk->faceCounts[i];
+    std::vector<vertex_index_t> &indices = chunk->faces[i].vertex_indices;
+    for (size_t k = 0; k < indices.size(); k++) {
+      vertex_index_t &vi = indices[k];
+      if (!fixIndex(vi.v_idx, offset.v + counts.v, &vi.v_idx)) {
+        chunk->failed = true;
+        return;
+      }
+      if (!fixIndex(vi.vn_idx, offset.vn + counts.vn, &vi.vn_idx)) {
+        vi.vn_idx = -1;
+      }
+      if (!fixIndex(vi.vt_idx, offset.vt + counts.vt, &vi.vt_idx)) {
+        vi.vt_idx = -1;
+      }
+    }
+  }
+}
+
 bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
              std::vector<material_t> *materials, std::string *err,
              const char *filename, const char *mtl_basedir, bool trianglulate) {
@@ -1316,25 +1707,114 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
   attrib->colors.clear();
   shapes->clear();
 
-  std::stringstream errss;
+  std::string baseDir;
+  if (mtl_basedir) {
+    baseDir = mtl_basedir;
+  }
+  MaterialFileReader matFileReader(baseDir);
+
+  MappedFile file(filename);
+  if (!file.data) {
+    // Empty files and ones that can't be mapped are read as a stream.
+    std::ifstream ifs(filename);
+    if (!ifs) {
+      std::stringstream errss;
+      errss << "Cannot open file [" << filename << "]" << std::endl;
+      if (err) {
+        (*err) = errss.str();
+      }
+      return false;
+    }
+    return LoadObj(attrib, shapes, materials, err, &ifs, &matFileReader,
+                   trianglulate);
+  }
+
+  // Split the file into a few chunks per thread, each starting on a new line.
+  size_t num_chunks =
+      std::min(static_cast<size_t>(omp_get_max_threads()) * 4,
+               file.size / min_chunk_size + 1);
+  std::vector<char *> bounds(num_chunks + 1);
+  char *file_end = file.data + file.size;
+  bounds[0] = file.data;
+  bounds[num_chunks] = file_end;
+  for (size_t i = 1; i < num_chunks; i++) {
+    char *start = std::max(file.data + file.size / num_chunks * i,
+                           bounds[i - 1]);
+    char *newline =
+        static_cast<char *>(memchr(start, '\n', file_end - start));
+    bounds[i] = newline ? newline + 1 : file_end;
+  }
 
-  std::ifstream ifs(filename);
-  if (!ifs) {
-    errss << "Cannot open file [" << filename << "]" << std::endl;
+  std::vector<obj_chunk> chunks(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < num_chunks; i++) {
+    parseChunk(bounds[i], bounds[i + 1], &chunks[i]);
+  }
+
+  // Where each chunk's attributes start in the merged arrays.
+  std::vector<size_t> v_offsets(num_chunks + 1, 0);
+  std::vector<size_t> vn_offsets(num_chunks + 1, 0);
+  std::vector<size_t> vt_offsets(num_chunks + 1, 0);
+  for (size_t i = 0; i < num_chunks; i++) {
+    v_offsets[i + 1] = v_offsets[i] + chunks[i].v.size();
+    vn_offsets[i + 1] = vn_offsets[i] + chunks[i].vn.size();
+    vt_offsets[i + 1] = vt_offsets[i] + chunks[i].vt.size();
+  }
+  attrib->vertices.resize(v_offsets[num_chunks]);
+  attrib->colors.resize(v_offsets[num_chunks]);
+  attrib->normals.resize(vn_offsets[num_chunks]);
+  attrib->texcoords.resize(vt_offsets[num_chunks]);
+
+  bool failed = false;
+#pragma omp parallel for schedule(dynamic) reduction(|| : failed)
+  for (size_t i = 0; i < num_chunks; i++) {
+    obj_chunk &chunk = chunks[i];
+    std::copy(chunk.v.begin(), chunk.v.end(),
+              attrib->vertices.begin() + v_offsets[i]);
+    std::copy(chunk.vc.begin(), chunk.vc.end(),
+              attrib->colors.begin() + v_offsets[i]);
+    std::copy(chunk.vn.begin(), chunk.vn.end(),
+              attrib->normals.begin() + vn_offsets[i]);
+    std::copy(chunk.vt.begin(), chunk.vt.end(),
+              attrib->texcoords.begin() + vt_offsets[i]);
+
+    attrib_counts offset;
+    offset.v = static_cast<int>(v_offsets[i] / 3);
+    offset.vn = static_cast<int>(vn_offsets[i] / 3);
+    offset.vt = static_cast<int>(vt_offsets[i] / 2);
+    fixChunkIndices(&chunk, offset);
+    failed = failed || chunk.failed;
+  }
+  if (failed) {
     if (err) {
-      (*err) = errss.str();
+      (*err) = "Failed parse `f' line(e.g. zero value for face index).\n";
     }
     return false;
   }
 
-  std::string baseDir;
-  if (mtl_basedir) {
-    baseDir = mtl_basedir;
+  // Statements group the faces around them, so they run in file order.
+  obj_state state;
+  for (size_t i = 0; i < num_chunks; i++) {
+    obj_chunk &chunk = chunks[i];
+    size_t next = 0;
+    for (size_t f = 0; f <= chunk.faces.size(); f++) {
+      while (next < chunk.statements.size() &&
+             chunk.statements[next].first == f) {
+        parseStatement(chunk.statements[next].second, &state, shapes,
+                       materials, &matFileReader, trianglulate,
+                       attrib->vertices, err);
+        next++;
+      }
+      if (f == chunk.faces.size()) break;
+
+      face_t &face = chunk.faces[f];
+      face.smoothing_group_id = state.current_smoothing_id;
+      state.faceGroup.push_back(std::move(face));
+    }
   }
-  MaterialFileReader matFileReader(baseDir);
+  finishShapes(&state, shapes, trianglulate, attrib->vertices);
 
-  return LoadObj(attrib, shapes, materials, err, &ifs, &matFileReader,
-                 trianglulate);
+  return true;
 }
 
 bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
@@ -1347,19 +1827,7 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
   std::vector<real_t> vn;
   std::vector<real_t> vt;
   std::vector<real_t> vc;
-  std::vector<tag_t> tags;
-  std::vector<face_t> faceGroup;
-  std::string name;
-
-  // material
-  std::map<std::string, int> material_map;
-  int material = -1;
-
-  // smoothing group id
-  unsigned int current_smoothing_id =
-      0;  // Initial value. 0 means no smoothing.
-
-  shape_t shape;
+  obj_state state;
 
   std::string linebuf;
   while (inStream->peek() != -1) {
@@ -1433,7 +1901,7 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
 
       face_t face;
 
-      face.smoothing_group_id = current_smoothing_id;
+      face.smoothing_group_id = state.current_smoothing_id;
       face.vertex_indices.reserve(3);
 
       while (!IS_NEW_LINE(token[0])) {
@@ -1453,217 +1921,16 @@ bool LoadObj(attrib_t *attrib, std::vector<shape_t> *shapes,
       }
 
       // replace with emplace_back + std::move on C++11
-      faceGroup.push_back(face);
+      state.faceGroup.push_back(face);
 
       continue;
     }
 
-    // use mtl
-    if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
-      token += 7;
-      std::stringstream ss;
-      ss << token;
-      std::string namebuf = ss.str();
-
-      int newMaterialId = -1;
-      if (material_map.find(namebuf) != material_map.end()) {
-        newMaterialId = material_map[namebuf];
-      } else {
-        // { error!! material not found }
-      }
-
-      if (newMaterialId != material) {
-        // Create per-face material. Thus we don't add `shape` to `shapes` at
-        // this time.
-        // just clear `faceGroup` after `exportFaceGroupToShape()` call.
-        exportFaceGroupToShape(&shape, faceGroup, tags, material, name,
-                               triangulate, v);
-        faceGroup.clear();
-        material = newMaterialId;
-      }
-
-      continue;
-    }
-
-    // load mtl
-    if ((0 == strncmp(token, "mtllib", 6)) && IS_SPACE((token[6]))) {
-      if (readMatFn) {
-        token += 7;
-
-        std::vector<std::string> filenames;
-        SplitString(std::string(token), ' ', filenames);
-
-        if (filenames.empty()) {
-          if (err) {
-            (*err) +=
-                "WARN: Looks like empty filename for mtllib. Use default "
-                "material. \n";
-          }
-        } else {
-          bool found = false;
-          for (size_t s = 0; s < filenames.size(); s++) {
-            std::string err_mtl;
-            bool ok = (*readMatFn)(filenames[s].c_str(), materials,
-                                   &material_map, &err_mtl);
-            if (err && (!err_mtl.empty())) {
-              (*err) += err_mtl;  // This should be warn message.
-            }
-
-            if (ok) {
-              found = true;
-              break;
-            }
-          }
-
-          if (!found) {
-            if (err) {
-              (*err) +=
-                  "WARN: Failed to load material file(s). Use default "
-                  "material.\n";
-            }
-          }
-        }
-      }
-
-      continue;
-    }
-
-    // group name
-    if (token[0] == 'g' && IS_SPACE((token[1]))) {
-      // flush previous face group.
-      bool ret = exportFaceGroupToShape(&shape, faceGroup, tags, material, name,
-                                        triangulate, v);
-      (void)ret;  // return value not used.
-
-      if (shape.mesh.indices.size() > 0) {
-        shapes->push_back(shape);
-      }
-
-      shape = shape_t();
-
-      // material = -1;
-      faceGroup.clear();
-
-      std::vector<std::string> names;
-      names.reserve(2);
-
-      while (!IS_NEW_LINE(token[0])) {
-        std::string str = parseString(&token);
-        names.push_back(str);
-        token += strspn(token, " \t\r");  // skip tag
-      }
-
-      assert(names.size() > 0);
-
-      // names[0] must be 'g', so skip the 0th element.
-      if (names.size() > 1) {
-        name = names[1];
-      } else {
-        name = "";
-      }
-
-      continue;
-    }
-
-    // object name
-    if (token[0] == 'o' && IS_SPACE((token[1]))) {
-      // flush previous face group.
-      bool ret = exportFaceGroupToShape(&shape, faceGroup, tags, material, name,
-                                        triangulate, v);
-      if (ret) {
-        shapes->push_back(shape);
-      }
-
-      // material = -1;
-      faceGroup.clear();
-      shape = shape_t();
-
-      // @todo { multiple object name? }
-      token += 2;
-      std::stringstream ss;
-      ss << token;
-      name = ss.str();
-
-      continue;
-    }
-
-    if (token[0] == 't' && IS_SPACE(token[1])) {
-      tag_t tag;
-
-      token += 2;
-
-      tag.name = parseString(&token);
-
-      tag_sizes ts = parseTagTriple(&token);
-
-      tag.intValues.resize(static_cast<size_t>(ts.num_ints));
-
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_ints); ++i) {
-        tag.intValues[i] = parseInt(&token);
-      }
-
-      tag.floatValues.resize(static_cast<size_t>(ts.num_reals));
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_reals); ++i) {
-        tag.floatValues[i] = parseReal(&token);
-      }
-
-      tag.stringValues.resize(static_cast<size_t>(ts.num_strings));
-      for (size_t i = 0; i < static_cast<size_t>(ts.num_strings); ++i) {
-        tag.stringValues[i] = parseString(&token);
-      }
-
-      tags.push_back(tag);
-
-      continue;
-    }
-
-    if (token[0] == 's' && IS_SPACE(token[1])) {
-      // smoothing group id
-      token += 2;
-
-      // skip space.
-      token += strspn(token, " \t");  // skip space
-
-      if (token[0] == '\0') {
-        continue;
-      }
-
-      if (token[0] == '\r' || token[1] == '\n') {
-        continue;
-      }
-
-      if (strlen(token) >= 3) {
-        if (token[0] == 'o' && token[1] == 'f' && token[2] == 'f') {
-          current_smoothing_id = 0;
-        }
-      } else {
-        // assume number
-        int smGroupId = parseInt(&token);
-        if (smGroupId < 0) {
-          // parse error. force set to 0.
-          // FIXME(syoyo): Report warning.
-          current_smoothing_id = 0;
-        } else {
-          current_smoothing_id = static_cast<unsigned int>(smGroupId);
-        }
-      }
-
-      continue;
-    }  // smoothing group id
-
-    // Ignore unknown command.
+    parseStatement(token, &state, shapes, materials, readMatFn, triangulate,
+                   v, err);
   }
 
-  bool ret = exportFaceGroupToShape(&shape, faceGroup, tags, material, name,
-                                    triangulate, v);
-  // exportFaceGroupToShape return false when `usemtl` is called in the last
-  // line.
-  // we also add `shape` to `shapes` when `shape.mesh` has already some
-  // faces(indices)
-  if (ret || shape.mesh.indices.size()) {
-    shapes->push_back(shape);
-  }
-  faceGroup.clear();  // for safety
+  finishShapes(&state, shapes, triangulate, v);
 
   if (err) {
     (*err) += errss.str();